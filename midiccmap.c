@@ -76,14 +76,40 @@
 //
 
 #include <alsa/asoundlib.h>     /* Interface to the ALSA system */
-#include <unistd.h> /* for usleep */
+#include <unistd.h> /* for pipe */
 #include <stdlib.h> /* for strtoul */
 #include <signal.h> /* for SIGINT handling */
+#include <ctype.h> /* for isalpha */
+#include <time.h> /* for clock_gettime */
+#include <math.h> /* for exp, log, tanh, pow */
+#include <stdint.h> /* for uint32_t */
+#include <stddef.h> /* for offsetof */
+#include <fcntl.h> /* for open */
+#include <sys/mman.h> /* for mmap */
+#include <sys/stat.h> /* for fstat */
+#include <sys/epoll.h> /* for epoll_wait */
+#include <pthread.h> /* for worker threads */
+
+// Status bytes are found with SSE2 or AVX2 when the CPU has them
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h> /* for _mm_movemask_epi8, _mm256_movemask_epi8 */
+#include <x86intrin.h> /* for __rdtsc */
+#define HAVE_SIMD (1)
+#endif
+
+// MIDI 2.0 Universal MIDI Packet rawmidi endpoints need alsa-lib 1.2.10
+#if SND_LIB_VERSION >= 0x01020a
+#define HAVE_UMP (1)
+#else
+typedef struct snd_ump snd_ump_t;
+#endif
 
 // Setting inBuffer size to 1 resulted in data loss
 // when using virtual midi port.
 // We need to expect several bytes in a single read.
-#define buf_size (1024)
+// buf_size is the largest read, the read size is set per port (-b, [Buffer])
+#define buf_size (4096)
+#define read_size (1024) // Default read size
 
 int verbose=0;
 int hexdump=0; // 0 -> decimal, 1 -> hex
@@ -93,26 +119,411 @@ static volatile int keepRunning = 1;
 // What about a per channel map?
 #define map_size (128)
 
-enum MapType {NONE, NRPN, RPN, CC, PB, AT};
-const char *mapNames[]={"NONE", "NRPN", "RPN", "CC", "PB", "AT"};
-const int mapNumMax[]={0, 16383, 16383, 127, 0, 0};
+// CC14 is a pair of controllers, MSB 0..31 and LSB 32..63
+// PAT is polyphonic aftertouch, its note is kept from source to destination
+enum MapType {NONE, NRPN, RPN, CC, PB, AT, CC14, PAT};
+const char *mapNames[]={"NONE", "NRPN", "RPN", "CC", "PB", "AT", "CC14", "PAT"};
+const int mapNumMax[]={0, 16383, 16383, 127, 0, 0, 31, 0};
 // Internal representation (pb as unsigned)
-const int mapToMin[]={0, 0, 0, 0, 0, 0};
-const int mapToMax[]={16383, 16383, 16383, 127, 16383, 127};
+const int mapToMin[]={0, 0, 0, 0, 0, 0, 0, 0};
+const int mapToMax[]={16383, 16383, 16383, 127, 16383, 127, 16383, 127};
 // External representation (pb as signed, default to midpoint, internally 8192)
 // used for parsing ini file
-const int mapFromDefault[]={0, 0, 0, 0, 0, 0};
-const int mapToDefault[]={0, 16383, 16383, 127, 8191, 127}; // Default to max
+const int mapFromDefault[]={0, 0, 0, 0, 0, 0, 0, 0};
+const int mapToDefault[]={0, 16383, 16383, 127, 8191, 127, 16383, 127}; // Default to max
+#define max_scale (1<<24) // Bound of scaling values, so that scaled products fit in a long
 
-struct MidiMap {
+// Role of a cc in a 14-bit pair
+enum HiResHalf {HIRES_NONE, HIRES_MSB, HIRES_LSB};
+
+// Data entry controllers sent for NRPN/RPN values
+// Receivers of 7-bit values may only want one of MSB or LSB
+// DATA_INC sends small changes as data increment/decrement
+enum DataEntry {DATA_BOTH, DATA_MSB, DATA_LSB, DATA_INC};
+const char *dataEntryNames[]={"both", "msb", "lsb", "inc", NULL};
+
+// Response curves, compiled into a lookup table per destination
+// Input and output are normalized to 0..1 over the source and destination ranges
+enum Curve {CURVE_LINEAR, CURVE_EXP, CURVE_LOG, CURVE_S, CURVE_GAMMA, CURVE_POINTS};
+const char *curveNames[]={"linear", "exp", "log", "s", NULL}; // gamma and points are set by their own option
+#define max_points (8)
+
+// Relative encoder value encodings
+// twos: 1..63 up, 127..64 down (two's complement)
+// sign: 1..63 up, 65..127 down (bit 6 is the sign)
+// offset: 65..127 up, 63..0 down (64 is no change)
+enum Relative {REL_NONE, REL_TWOS, REL_SIGN, REL_OFFSET};
+const char *relativeNames[]={"none", "twos", "sign", "offset", NULL};
+
+// Poly aftertouch sent to a channel-wide destination
+enum Collapse {COLLAPSE_MAX, COLLAPSE_AVG};
+const char *collapseNames[]={"max", "avg", NULL};
+
+// Optional per-mapping settings, given as name=value after the range in ini file
+struct MapOptions {
+	int deadband; // Input changes of this many steps or less are ignored
+	int hysteresis; // Steps needed to emit a value after a change of direction
+	int lsbTimeout; // 14-bit cc source: ms to wait for LSB before sending MSB alone
+	int dataEntry; // enum DataEntry, NRPN/RPN destination only
+	int incMax; // DATA_INC: most increments sent for one change, larger ones are sent as data entry
+	int pickup; // Soft takeover window in output units, -1 if off
+	int curve; // enum Curve
+	double shape; // Steepness of exp, log and s curves, exponent of gamma curve
+	int pointCount; // Breakpoints of piecewise linear curve
+	unsigned char points[max_points][2]; // Input and output, percent of range
+	// Input shaping, applied before the curve
+	int inMin; // Source values at or below inMin give the start of output range
+	int inMax; // Source values at or above inMax give the end, -1 for source max
+	int deadzone; // Source values this close to the middle of input range give the middle output
+	int invert; // Input range is reversed
+	// Relative encoder source
+	int encoding; // enum Relative
+	int step; // Position change for one detent, 14-bit units
+	double accel; // Step for n detents at once is step*n^accel
+	// Poly aftertouch source
+	int thin; // PAT destination: per note changes of this many steps or less are dropped
+	int collapse; // Other destinations: enum Collapse, over notes with pressure
+};
+const struct MapOptions defaultOptions={0, 0, 5, DATA_BOTH, 2, -1, CURVE_LINEAR, 4.0, 0, {{0}}, 0, -1, 0, 0, REL_TWOS, 32, 1.0, 0, COLLAPSE_MAX};
+
+// One source can be layered on a few destinations
+#define max_dests (4)
+
+// Output message of a destination is prebuilt, only channel and value
+// (and note for PAT) are patched in when sending
+#define max_template (13) // NRPN/RPN select, data entry MSB and LSB, reset
+
+// Destination of a mapping, with its scaling
+struct MidiDest {
 	enum MapType type;
 	unsigned int num;
 	int valFrom;
 	int valTo;
+	struct MapOptions options;
+	int curve; // Offset of lookup table in curveTables, -1 for plain linear scaling
+	unsigned int srcMax; // Largest source value, 127 or 16383
+	unsigned char tmpl[max_template]; // Output message, status with channel 0
+	unsigned char tmplLen;
+	unsigned char tmplHi; // Index of value bits 7-13 in template, 0 if none
+	unsigned char tmplLo; // Index of value bits 0-6 in template, 0 if none
+	int state; // Run time state is port->destStates[state-1], 0 if none yet
+	int out; // Output state is port->outStates[out-1], shared by destinations of same type and number
+};
+
+struct MidiMap {
+	int destCount; // 0 when not mapped, message is passed through
+	struct MidiDest dest[max_dests];
+	// 14-bit source (cc pair or NRPN/RPN data entry)
+	enum HiResHalf hiRes; // Role of the cc, HIRES_MSB for NRPN/RPN sources
+	unsigned char pairNum; // Cc number of the other half of a pair
+	char independent; // Halves are separate coarse and fine knobs
+	int lsbTimeout; // ms to wait for LSB before sending MSB alone
+	// Relative encoder source, position is accumulated in msb and lsb of the state
+	enum Relative relative; // REL_NONE for absolute sources
+	unsigned short relStep[65]; // Position change for each number of detents
+	int state; // Run time state is port->mapStates[state-1], 0 if none yet
+};
+
+// Run time state of maps and destinations, per channel
+// It is kept by the port, apart from the maps: maps are only read while
+// MIDI flows, so that a map image is used in place, read-only.
+struct MapState {
+	// 14-bit source
+	unsigned char msb[16];
+	unsigned char lsb[16];
+	char lsbSeen[16]; // The controller sends LSB on this channel
+	long long lsbDeadline[16]; // Time (us) when MSB will be sent alone, 0 if no LSB expected
+};
+struct DestState {
+	// Input filter
+	int lastIn[16]; // Last input value that was let through, -1 if none yet
+	signed char lastDir[16]; // Direction of last accepted change, -1, 0 or 1
+	// Soft takeover
+	int pickupPrev[16]; // Previous value while waiting, -1 if none
+	unsigned int pickupSwitch[16]; // Value of bankSwitches when last checked
+	char pickedUp[16]; // Control has reached the output value since the bank switch
+};
+// Run time state of an output destination, per channel
+// Keyed by destination type and number: every bank and map sending to the
+// same controller or parameter shares it, so that it holds what the receiver has.
+#define OUT_KEY(type, num) (((type)<<14)+(num))
+struct OutState {
+	int key; // OUT_KEY of the destinations sending here
+	char pickup; // A destination with soft takeover sends here, values must be recorded
+	int pickupLast[16]; // Soft takeover: last value sent, -1 if none yet
+	int lastOut[16]; // NRPN/RPN: value the receiver has for data increments, -1 if unknown
+	unsigned int incSwitch[16]; // Value of bankSwitches when lastOut was set
+};
+// Parameter selection state, per channel
+// Parameters are keyed as (rpn<<14)+number
+#define PARM_KEY(rpn, num) (((rpn)<<14)+(num))
+#define PARM_NULL PARM_KEY(1, 0x3FFF) // RPN 127/127 deselects
+struct ParmSelect {
+	unsigned char rpn;
+	unsigned char msb;
+	unsigned char lsb;
+};
+
+// MPE zones
+// A zone has a master channel and member channels, one per sounding note.
+// Pitch bend and pressure on member channels go through the member maps
+// of the bank (or pass through), and can be rate limited as a whole.
+struct MpeConfig {
+	int lower; // Member channels of lower zone (2 and up, master 1), 0 if none
+	int upper; // Member channels of upper zone (15 and down, master 16), 0 if none
+	int rate; // Most member pitch bend and pressure messages per second, 0 for no limit
+};
+
+// A complete set of maps, several can be loaded and switched at run time
+#define max_banks (128) // Selectable by program change
+struct MapBank {
+	char name[32];
+	struct MidiMap ccMaps[map_size]; // CC mapping for each CC
+	struct MidiMap atMap; // After-touch mapping
+	struct MidiMap pbMap; // Pitch bend mapping
+	struct MidiMap patMap; // Poly aftertouch mapping
+	struct MidiMap mpePbMap; // Pitch bend on MPE member channels
+	struct MidiMap mpeAtMap; // Pressure on MPE member channels
+	// NRPN and RPN source maps, indexed by parameter MSB then LSB
+	// Pages of 128 entries are only allocated for MSB values actually mapped
+	int parmPages[2][128]; // [0] NRPN, [1] RPN: index + 1 in port->parmPages, 0 if none
+	int parmDecode; // Decode incoming NRPN/RPN, set when at least one is mapped
+};
+struct MapBank *editBank=NULL; // Bank being set by ini file or command line
+
+// Messages that switch banks, they are not passed through
+// Channels are 0..15, or -1 for any channel
+struct BankSelect {
+	int pc; // Program change number is the bank index
+	int pcChannel;
+	int cc; // Controller number whose value is the bank index, -1 if none
+	int ccChannel;
+	int sysex; // F0 7D 62 index F7
+};
+const unsigned char bankSysex[]={0xF0, 0x7D, 0x62}; // Non-commercial id, 'b'
+
+// Compiled map image, written by --compile and loaded with -i
+// Layout: header, banks, NRPN/RPN pages, NRPN/RPN maps, offsets of 14-bit source maps,
+// curve tables.
+// Everything is stored as in memory. Maps hold no pointers (pages and run time
+// state are found by index), so the file is mapped read-only and used in place,
+// its pages shared by all processes using it.
+// Images are only valid for the build that wrote them (structure sizes are checked).
+#define image_version (7)
+#define image_align(n) (((n)+15) & ~15)
+const char imageMagic[8]="MCCMAP\0";
+struct MapImageHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t bankSize; // sizeof(struct MapBank)
+	uint32_t mapSize; // sizeof(struct MidiMap)
+	uint32_t size; // Whole file
+	uint32_t checksum; // FNV-1a of everything after the header
+	uint32_t bankCount;
+	uint32_t pageCount; // NRPN/RPN pages, 128 map pointers each
+	uint32_t parmCount; // NRPN/RPN maps
+	uint32_t hiResCount;
+	uint32_t curveSize; // Entries in curve tables
+	uint32_t mapStateCount; // Run time state records, allocated when loading
+	uint32_t destStateCount;
+	uint32_t outStateCount;
+	struct BankSelect bankSelect;
+	struct MpeConfig mpe;
+};
+void editImage();
+
+// Output stream, messages are queued and written in a single call
+// once the whole input buffer has been processed
+// With a UMP endpoint, mapped values are sent as MIDI 2.0 packets
+// and other bytes are converted to MIDI 1.0 packets.
+// Several ports can send to the same output (routing). Their messages
+// share running status, and are held back while another port is in the
+// middle of a sysex on this output.
+struct Port;
+struct MidiOut {
+	snd_rawmidi_t *handle;
+	snd_ump_t *ump; // UMP output endpoint, NULL for MIDI 1.0 byte stream
+	int umpOut; // Output is UMP packets, to the endpoint or to fd in filter mode (-U -)
+	unsigned char buffer[buf_size];
+	int count;
+	unsigned char runningStatus; // Current MIDI Status in output stream
+	int fd; // Without ALSA handle: file of filter mode, -1 to drop output (benchmark)
+	int parmOut[16]; // NRPN/RPN selected in output stream, per channel, -1 if unknown
+	struct Port *sysexPort; // Port sending a sysex, NULL if none
+	unsigned char held[buf_size]; // Messages of other ports, sent when the sysex ends
+	int heldCount;
+	struct Port *heldSysexPort; // Port of a sysex started in held messages
+	int heldFull; // Held messages were dropped during this sysex, and a warning printed
+	// MIDI 1.0 bytes to UMP conversion
+	unsigned char umpMsg[6]; // Message being assembled, status first, or sysex data
+	int umpLen; // Bytes in umpMsg
+	int umpNeed; // Bytes making a complete message, -1 in sysex
+	int umpSysexStarted; // A sysex start packet was sent
+};
+#define ump_group (0) // Group of all UMP output
+
+// MIDI 2.0 input
+// Packets are decoded to MIDI 1.0 bytes and go through the same parser.
+// The 32-bit value of a controller, pitch bend, pressure or NRPN/RPN
+// is kept by the last byte of its message, and replaces the reduced
+// value when the source is mapped.
+enum Wide {WIDE_NONE, WIDE_VALUE, WIDE_PARM_MSB, WIDE_PARM_LSB};
+struct UmpIn {
+	snd_ump_t *handle;
+	uint32_t words[buf_size/8]; // Read buffer, a packet split between reads is completed by the next one
+	int count; // Words in read buffer
+	uint32_t wide[buf_size]; // 32-bit value, by index of byte in input buffer
+	unsigned char wideKind[buf_size]; // enum Wide, by index of byte in input buffer
 };
-struct MidiMap ccMaps[map_size]; // CC mapping for each CC
-struct MidiMap atMap; // After-touch mapping
-struct MidiMap pbMap; // Pitch bend mapping
+
+// Input is processed a whole buffer at a time, in a pipeline:
+// bytes are decoded to an array of events (midiDecode), which are then
+// mapped and encoded to the output batch (portEvents).
+// An event is a complete message. A sysex is passed as chunks of input
+// bytes, split by real time messages and buffer ends.
+struct MidiEvent {
+	unsigned char status; // With channel, F0 for a sysex chunk
+	unsigned char num; // First data byte: note, controller, program; sysex: 1 if the chunk ends the sysex
+	unsigned short value; // Second data byte (or the only one), 14-bit value of pitch bend and song position
+	unsigned short at; // Index in input buffer of last byte (for UMP values), or of first byte of a sysex chunk
+	unsigned short len; // Bytes in sysex chunk
+};
+
+// Input parser state, kept between reads
+struct Parser {
+	// Decoding
+	unsigned char runningStatusIn; // Current MIDI Status from input stream, 0 if none
+	unsigned char data[2]; // Data bytes of a message split between reads
+	int dataLen;
+	int inSysex; // Receiving a sysex
+	// Mapping
+	int sysexLen; // Bytes of a possible bank select sysex held back, 0 if none
+	unsigned char sysexIndex;
+	int midMessage; // Output is in the middle of a sysex, nothing can be inserted
+};
+
+// Routing of output messages to the output of another port
+// The first matching route of the port applies, messages that match
+// none go to the port's own output.
+// Mapped messages are routed by destination type and number,
+// passed through ones by status, channel and first data byte.
+enum RouteType {ROUTE_ANY, ROUTE_NOTE, ROUTE_PAT, ROUTE_CC, ROUTE_PC, ROUTE_AT, ROUTE_PB, ROUTE_CC14, ROUTE_NRPN, ROUTE_RPN, ROUTE_SYS};
+const char *routeNames[]={"*", "NOTE", "PAT", "CC", "PC", "AT", "PB", "CC14", "NRPN", "RPN", "SYS"};
+const enum RouteType routeOfMap[]={ROUTE_ANY, ROUTE_NRPN, ROUTE_RPN, ROUTE_CC, ROUTE_PB, ROUTE_AT, ROUTE_CC14, ROUTE_PAT}; // By enum MapType
+const enum RouteType routeOfStatus[]={ROUTE_NOTE, ROUTE_NOTE, ROUTE_PAT, ROUTE_CC, ROUTE_PC, ROUTE_AT, ROUTE_PB, ROUTE_SYS}; // By status high nibble - 8
+#define max_routes (32)
+struct Route {
+	enum RouteType type;
+	int channelFrom, channelTo; // 0..15, -1 for any channel (system messages only match any)
+	int numFrom, numTo; // Note, controller, program or parameter number, -1 for any
+	char to[32]; // Name of the port whose output is used
+	struct MidiOut *out; // Set once all ports are known
+};
+
+// Read size and ALSA rawmidi buffer parameters of a port, 0 keeps the driver default
+// A larger ALSA buffer absorbs long sysex transfers without overrun,
+// smaller reads get the first bytes of a burst out sooner (output is
+// written once per read).
+struct BufferConfig {
+	int readSize; // Bytes read at once, up to buf_size
+	size_t bufferSize; // ALSA buffer of input and output
+	size_t availMin; // Input bytes that make the port ready
+	int noActiveSensing; // No active sensing sent by ALSA when output is closed
+};
+const char *bufferPresetNames[]={"latency", "throughput"};
+const struct BufferConfig bufferPresets[]={
+	{256, 4096, 1, 0},
+	{buf_size, 65536, 1, 0},
+};
+
+// A MIDI port with its own maps, parser and stream state
+// One process can serve several ports. Functions work on the current port,
+// set by the loop before input of a port is parsed (and while it is configured).
+#define max_ports (64)
+struct Port {
+	char name[32];
+	// Maps
+	struct MapBank *banks[max_banks];
+	int bankCount;
+	struct MapBank *bank; // Active bank, switching is a single pointer store (and a counter)
+	unsigned int bankSwitches; // Incremented when active bank changes, for soft takeover
+	struct BankSelect bankSelect;
+	struct MpeConfig mpe;
+	// Lookup tables of curved destinations, one entry per source value
+	// The pool only grows, destinations refer to their table by offset
+	unsigned short *curveTables;
+	size_t curveSize;
+	// NRPN/RPN source maps of all banks, found by index + 1 from MapBank.parmPages
+	int (*parmPages)[128]; // Index + 1 in parmMaps for each parameter LSB, 0 if none
+	int pageCount;
+	struct MidiMap **parmMaps;
+	int parmCount;
+	int poolsMapped; // Curve tables and NRPN/RPN pages are in a map image, copy before growing
+	unsigned char *image; // Map image in use, mapped read-only, NULL if none
+	unsigned char *imageCopy; // Private copy of an image whose maps are changed, NULL if none
+	size_t imageSize;
+	// Run time state of maps and destinations, found by index from them
+	struct MapState *mapStates;
+	int mapStateCount;
+	struct DestState *destStates;
+	int destStateCount;
+	struct OutState *outStates; // Keys and flags are set from the maps
+	int outStateCount;
+	int dataInc; // A destination sends data increments, data entry passed through is tracked
+	int hiResPending; // Number of MSB waiting for their LSB
+	struct MidiMap **hiResMaps; // All maps with a 14-bit source, for LSB timeouts
+	int hiResCount;
+	// Parameter selection state, per channel
+	struct ParmSelect parmIn[16]; // Selected by input stream
+	// MPE
+	char mpeMember[16]; // Channel is a member channel
+	// Rate limiting: a token bucket, values over budget are held back,
+	// only the latest one per channel and type is kept
+	double mpeTokens;
+	long long mpeRefill; // Time (us) of last refill
+	int mpeHeld[2][16]; // [0] pitch bend, [1] pressure: input value held back, -1 if none
+	int mpeHeldCount;
+	int mpeNext; // Next channel and type to flush, so that all get their turn
+	// Poly aftertouch state, per channel and note
+	unsigned char polyIn[16][128]; // Current pressure, 0 when released
+	int polyCount[16]; // Notes with pressure
+	int polySum[16];
+	unsigned char polyMax[16];
+	unsigned char polyOut[max_dests][16][128]; // Last input value sent per note, by destination index
+	int polyCollapsed[max_dests][16]; // Last collapsed value sent, by destination index, -1 if none
+	// Input and output
+	char *umpDevice; // UMP output endpoint, like hw:1,0
+	char *umpInDevice; // UMP input endpoint
+	snd_rawmidi_t *midiin;
+	struct UmpIn umpIn;
+	struct MidiOut out;
+	struct Parser parser;
+	struct Route routes[max_routes];
+	int routeCount;
+	int worker; // Thread serving the port, ports linked by routes share one
+	struct BufferConfig buffer;
+	// Stream statistics, printed on exit
+	unsigned long bytesIn;
+	unsigned long overruns; // Checks or reads that found input bytes lost
+	unsigned long bytesLost; // Input bytes dropped by ALSA, when known
+	unsigned long xrunsOut;
+	size_t backlogMax; // Most input bytes left waiting after a read
+	size_t roomMin; // Least free space in output buffer
+	long long statusTime; // Last status check (us)
+	size_t resyncAfter; // Input bytes still to read before the gap of an overrun, 0 if none
+	unsigned long heldDropped; // Output bytes dropped while another port's sysex held a routed output
+};
+struct Port *ports[max_ports];
+int portCount=0;
+__thread struct Port *port=NULL; // Current port, per thread
+
+// Input and output status (overruns) is checked at most every status_interval us
+#define status_interval (10000)
+
+// Ports are shared among worker threads, each waits for its own ports
+#define max_threads (16)
+int threadCount=1;
+int stopPipe[2]; // Written on Ctrl-C, wakes all threads
 
 void errormessage(const char *format, ...);
 
@@ -152,6 +563,7 @@ cc = [
 
 void intHandler(int dummy) {
     keepRunning = 0;
+    write(stopPipe[1], "", 1);
 }
 
 int usage(const char * command){
@@ -164,20 +576,307 @@ int usage(const char * command){
 	printf("-r\t\ttreat the following as cc/rpn pairs\n");
 	printf("-c\t\ttreat the following as cc/cc pairs\n");
 	printf("-f file\t\tread map from the specified file\n");
+	printf("-i file\t\tload a compiled map image, replacing current maps\n");
+	printf("-U device\tsend to a MIDI 2.0 UMP endpoint, mapped values as 32-bit controllers\n");
+	printf("\t\twith --filter, -U - writes the UMP packets to standard output\n");
+	printf("-u device\treceive from a MIDI 2.0 UMP endpoint, 32-bit values are mapped as is\n");
+	printf("-P name\t\tstart a new port, the options that follow apply to it\n");
+	printf("-t n\t\tserve ports with n threads\n");
+	printf("-b buffer\tlatency, throughput or read,size,avail: read size, ALSA buffer size and avail min\n");
+	printf("-S\t\tno active sensing sent by ALSA when output is closed\n");
+	printf("--compile file\tcheck maps and write them as an image, then exit\n");
+	printf("--filter\tmap MIDI bytes from standard input to standard output, without ALSA\n");
+	printf("--bench n\ttime decoding (per scanner) and mapping of n generated input buffers, then exit\n");
 	printf("cc is a midi controller number (0 to 127)\n");
 	printf("value is destination:\n");
 	printf("\t0 to 127 for cc to cc mapping\n");
 	printf("\t0 to 16383 for cc to rpn/nrpn mapping\n");
+	printf("14-bit cc pairs (cc n and n+32) can be mapped from and to in .ini file only\n");
 	printf("cc and values are in decimal or in hex with 0x prefix\n");
 	printf("Please note that cc and at values are only 7 bits.\n");
 	printf("rpn/nrpn/pitch bend are 14 bit values, and will be scaled accordingly,\n");
 	printf("but the output will only have 128 distinct values.\n");
 }
 
-int setMidiMap(struct MidiMap *map, const enum MapType destType, const unsigned destNum, const long destValFrom, const long destValTo){
+// Run time state of a map or destination of the current port
+struct MapState *mapState(const struct MidiMap *map){
+	return(&port->mapStates[map->state-1]);
+}
+
+struct DestState *destState(const struct MidiDest *dest){
+	return(&port->destStates[dest->state-1]);
+}
+
+void resetMapState(struct MapState *st){
+	for(int c=0; c<16; c++){
+		st->msb[c]=0;
+		st->lsb[c]=0;
+		st->lsbSeen[c]=0;
+		if(st->lsbDeadline[c]) port->hiResPending--;
+		st->lsbDeadline[c]=0;
+	}
+}
+
+void resetDestState(struct DestState *st){
+	for(int c=0; c<16; c++){
+		st->lastIn[c]=-1;
+		st->lastDir[c]=0;
+		st->pickupPrev[c]=-1;
+		st->pickupSwitch[c]=0;
+		st->pickedUp[c]=1;
+	}
+}
+
+// Allocate run time state for the maps of an image, or a new map or destination
+// Returns the index + 1 of the last record
+int addMapStates(const int count){
+	port->mapStates=realloc(port->mapStates, (port->mapStateCount+count)*sizeof(*port->mapStates));
+	if(port->mapStateCount+count && port->mapStates==NULL){
+		errormessage("Error: out of memory");
+		exit(-1);
+	}
+	memset(port->mapStates+port->mapStateCount, 0, count*sizeof(*port->mapStates));
+	port->mapStateCount+=count;
+	return(port->mapStateCount);
+}
+
+int addDestStates(const int count){
+	port->destStates=realloc(port->destStates, (port->destStateCount+count)*sizeof(*port->destStates));
+	if(port->destStateCount+count && port->destStates==NULL){
+		errormessage("Error: out of memory");
+		exit(-1);
+	}
+	for(int i=port->destStateCount; i<port->destStateCount+count; i++) resetDestState(&port->destStates[i]);
+	port->destStateCount+=count;
+	return(port->destStateCount);
+}
+
+void resetOutState(struct OutState *o){
+	for(int c=0; c<16; c++){
+		o->pickupLast[c]=-1;
+		o->lastOut[c]=-1;
+		o->incSwitch[c]=0;
+	}
+}
+
+// Output state of a destination type and number, added if new
+// Returns its index + 1
+int outStateOf(const enum MapType type, const unsigned num){
+	int key=OUT_KEY(type, num);
+	for(int i=0; i<port->outStateCount; i++){
+		if(port->outStates[i].key==key) return(i+1);
+	}
+	port->outStates=realloc(port->outStates, (port->outStateCount+1)*sizeof(*port->outStates));
+	if(port->outStates==NULL){
+		errormessage("Error: out of memory");
+		exit(-1);
+	}
+	memset(&port->outStates[port->outStateCount], 0, sizeof(*port->outStates));
+	port->outStates[port->outStateCount].key=key;
+	resetOutState(&port->outStates[port->outStateCount]);
+	return(++port->outStateCount);
+}
+
+// Set key and flags of the output states used by the destinations of a map
+void linkOutStates(const struct MidiMap *map){
+	struct OutState *o;
+	for(int d=0; d<map->destCount; d++){
+		o=&port->outStates[map->dest[d].out-1];
+		o->key=OUT_KEY(map->dest[d].type, map->dest[d].num);
+		if(map->dest[d].options.pickup>=0) o->pickup=1;
+		if(map->dest[d].options.dataEntry==DATA_INC) port->dataInc=1;
+	}
+}
+
+// Data entry for a NRPN/RPN was passed through on a channel, key -1 if the
+// parameter is unknown: data increments must start from an absolute value
+void parmPassed(const unsigned char channel, const int key){
+	for(int i=0; i<port->outStateCount; i++){
+		if(key<0 || port->outStates[i].key==key) port->outStates[i].lastOut[channel]=-1;
+	}
+}
+
+// Clear all destinations and 14-bit source state
+void clearMidiMap(struct MidiMap *map){
+	map->destCount=0;
+	map->hiRes=HIRES_NONE;
+	map->independent=0;
+	map->lsbTimeout=defaultOptions.lsbTimeout;
+	map->relative=REL_NONE;
+	if(map->state) resetMapState(mapState(map));
+}
+
+// Curve value for normalized input x, 0..1
+double curveValue(const struct MapOptions *options, const double x){
+	double k=options->shape;
+	int p;
+	switch(options->curve){
+		case CURVE_EXP:
+			return((exp(k*x)-1)/(exp(k)-1));
+		case CURVE_LOG:
+			return(log(1+(exp(k)-1)*x)/k);
+		case CURVE_S:
+			return((tanh(k*(x-0.5))/tanh(k/2)+1)/2);
+		case CURVE_GAMMA:
+			return(pow(x, k));
+		case CURVE_POINTS:
+			// Flat before first and after last point
+			if(x*100<=options->points[0][0]) return(options->points[0][1]/100.0);
+			for(p=1; p<options->pointCount; p++){
+				if(x*100<=options->points[p][0]){
+					double x0=options->points[p-1][0], y0=options->points[p-1][1];
+					double x1=options->points[p][0], y1=options->points[p][1];
+					return((y0+(x*100-x0)*(y1-y0)/(x1-x0))/100);
+				}
+			}
+			return(options->points[p-1][1]/100.0);
+		default:
+			return(x);
+	}
+}
+
+// Position of a source value in the input range, 0..1
+// after input range, deadzone and inversion
+double inputPosition(const struct MapOptions *options, const unsigned int val, const unsigned int srcMax){
+	double inMin=options->inMin;
+	double inMax=(options->inMax<0)?srcMax:options->inMax;
+	double center=(inMin+inMax)/2, half=(inMax-inMin)/2;
+	double x, d;
+	if(val<=inMin) x=0;
+	else if(val>=inMax) x=1;
+	else if(options->deadzone){
+		d=val-center;
+		if(fabs(d)<=options->deadzone) x=0.5;
+		else if(d>0) x=0.5+(d-options->deadzone)/(half-options->deadzone)/2;
+		else x=0.5+(d+options->deadzone)/(half-options->deadzone)/2;
+	}else x=(val-inMin)/(inMax-inMin);
+	return(options->invert?1-x:x);
+}
+
+// Pools loaded from an image are read in place, copy them before a change
+void copyPools(){
+	unsigned short *tables=malloc(port->curveSize*sizeof(*port->curveTables));
+	int (*pages)[128]=malloc(port->pageCount*sizeof(*port->parmPages));
+	if((port->curveSize && tables==NULL) || (port->pageCount && pages==NULL)){
+		errormessage("Error: out of memory");
+		exit(-1);
+	}
+	memcpy(tables, port->curveTables, port->curveSize*sizeof(*port->curveTables));
+	memcpy(pages, port->parmPages, port->pageCount*sizeof(*port->parmPages));
+	port->curveTables=tables;
+	port->parmPages=pages;
+	port->poolsMapped=0;
+}
+
+// Input shaping or curve needs a table
+int needCurveTable(const struct MapOptions *options){
+	return(options->curve!=CURVE_LINEAR || options->inMin || options->inMax>=0 || options->deadzone || options->invert);
+}
+
+// Compile input shaping and curve of a destination into a table of srcMax+1 entries
+// Values are scaled to the destination range and clipped, so that
+// sending a shaped value is a single lookup.
+// reuse is the offset of a table of the same size to overwrite, -1 to add one
+// Returns the offset of the table in curveTables
+int addCurveTable(const struct MidiDest *dest, const unsigned int srcMax, const int reuse){
+	unsigned short *table;
+	size_t size=port->curveSize+((reuse<0)?srcMax+1:0);
+	int offset=(reuse<0)?port->curveSize:reuse;
+	long val;
+	if(port->poolsMapped) copyPools();
+	table=realloc(port->curveTables, size*sizeof(*port->curveTables));
+	if(table==NULL){
+		errormessage("Error: out of memory");
+		exit(-1);
+	}
+	port->curveTables=table;
+	table+=offset;
+	for(unsigned int i=0; i<=srcMax; i++){
+		val=lround(dest->valFrom+curveValue(&dest->options, inputPosition(&dest->options, i, srcMax))*(dest->valTo-dest->valFrom));
+		if(val<mapToMin[dest->type]) val=mapToMin[dest->type];
+		if(val>mapToMax[dest->type]) val=mapToMax[dest->type];
+		table[i]=val;
+	}
+	port->curveSize=size;
+	return(offset);
+}
+
+// Prebuild the output message of a destination
+// NRPN/RPN with DATA_INC do not use it, what they send depends on the previous value
+void buildTemplate(struct MidiDest *dest){
+	unsigned char *t=dest->tmpl;
+	int k=0;
+	dest->tmplHi=dest->tmplLo=0;
+	switch(dest->type){
+		case NRPN:
+		case RPN:
+			t[k++]=0xB0;
+			t[k++]=(dest->type == RPN)?0x65:0x63;
+			t[k++]=(dest->num>>7)&0x7F;
+			t[k++]=(dest->type == RPN)?0x64:0x62;
+			t[k++]=dest->num&0x7F;
+			// Coarse modes send the scaled value reduced to 7 bits,
+			// which with default range is the 7-bit source value itself
+			if(dest->options.dataEntry!=DATA_LSB){
+				t[k++]=0x06; // Data entry MSB
+				dest->tmplHi=k++;
+			}
+			if(dest->options.dataEntry==DATA_LSB){
+				t[k++]=0x26; // Data entry LSB
+				dest->tmplHi=k++;
+			}else if(dest->options.dataEntry!=DATA_MSB){
+				t[k++]=0x26; // Data entry LSB
+				dest->tmplLo=k++;
+			}
+			// The following prevent accidental change of NRPN value
+			t[k++]=0x65; // RPN MSB
+			t[k++]=0x7F;
+			t[k++]=0x64; // RPN LSB
+			t[k++]=0x7F;
+			break;
+		case CC:
+			t[k++]=0xB0;
+			t[k++]=dest->num;
+			dest->tmplLo=k++;
+			break;
+		case CC14: // MSB on num, LSB on num+32
+			t[k++]=0xB0;
+			t[k++]=dest->num;
+			dest->tmplHi=k++;
+			t[k++]=dest->num+32;
+			dest->tmplLo=k++;
+			break;
+		case PB:
+			t[k++]=0xE0;
+			dest->tmplLo=k++;
+			dest->tmplHi=k++;
+			break;
+		case AT:
+			t[k++]=0xD0;
+			dest->tmplLo=k++;
+			break;
+		case PAT:
+			t[k++]=0xA0;
+			k++; // Note
+			dest->tmplLo=k++;
+			break;
+		default:
+			break;
+	}
+	dest->tmplLen=k;
+}
+
+// Add a destination to a map, or clear the map if destType is NONE
+// A destination with the same type and number replaces the previous one
+// srcMax is the largest source value, 127 or 16383
+int setMidiMap(struct MidiMap *map, const unsigned int srcMax, const enum MapType destType, const unsigned destNum, const long destValFrom, const long destValTo, const struct MapOptions *options){
 	long valMin, valMax;
+	struct MidiDest *dest;
+	int d, reuse;
+	if (options==NULL) options=&defaultOptions;
 	switch (destType) {
 		case CC:
+		case CC14:
 		case RPN:
 		case NRPN:
 			if(destNum>mapNumMax[destType]){
@@ -187,6 +886,7 @@ int setMidiMap(struct MidiMap *map, const enum MapType destType, const unsigned
 			break;
 		case PB:
 		case AT:
+		case PAT:
 		case NONE:
 			if(destNum!=0){
 				errormessage("Error: invalid destination parameter number %u", destNum);
@@ -197,10 +897,22 @@ int setMidiMap(struct MidiMap *map, const enum MapType destType, const unsigned
 			errormessage("Error: invalid map type %u", destType);
 			return(-1);
 	}
+	if(destType==NONE){
+		if(verbose) printf(" unmapped\n");
+		clearMidiMap(map);
+		return(0);
+	}
 	
-	// Check for duplicate definition
-	if(map->type!=NONE){
-		errormessage("Warning: new mapping overrides previous one.");
+	// Check for duplicate definition, other destinations are added
+	for(d=0; d<map->destCount; d++){
+		if(map->dest[d].type==destType && map->dest[d].num==destNum){
+			errormessage("Warning: new mapping overrides previous one.");
+			break;
+		}
+	}
+	if(d==max_dests){
+		errormessage("Error: too many destinations for one source (max %d)", max_dests);
+		return(-1);
 	}
 	
 	// Scaling values below are deliberately not checked.
@@ -217,9 +929,46 @@ int setMidiMap(struct MidiMap *map, const enum MapType destType, const unsigned
 		errormessage("Error: unusable output range %d .. %d\n", destValFrom, destValTo);
 		return(-1);
 	}
+	if(labs(destValFrom)>max_scale || labs(destValTo)>max_scale){
+		errormessage("Error: output range %ld .. %ld too large", destValFrom, destValTo);
+		return(-1);
+	}
 	if((destValFrom<valMin)||(destValTo<valMin)||(destValFrom>valMax)||(destValTo>valMax)){
 		errormessage("Warning: output will be clipped");
 	}
+	if(options->deadband<0 || options->hysteresis<0){
+		errormessage("Error: deadband and hysteresis must not be negative");
+		return(-1);
+	}
+	if(options->dataEntry!=DATA_BOTH && destType!=NRPN && destType!=RPN){
+		errormessage("Error: data entry setting only applies to NRPN and RPN");
+		return(-1);
+	}
+	if(options->pickup>mapToMax[destType]){
+		errormessage("Error: pickup window larger than output range");
+		return(-1);
+	}
+	if(options->thin<0){
+		errormessage("Error: thin must not be negative");
+		return(-1);
+	}
+	if(options->incMax<1 || options->incMax>63){
+		errormessage("Error: incmax must be 1 to 63");
+		return(-1);
+	}
+	if(options->curve!=CURVE_LINEAR && options->curve!=CURVE_POINTS && options->shape<=0){
+		errormessage("Error: curve shape and gamma must be positive");
+		return(-1);
+	}
+	if(options->inMin<0 || options->inMax>(int)srcMax || (options->inMax>=0 && options->inMax<=options->inMin)
+		|| (options->inMax<0 && options->inMin>=srcMax)){
+		errormessage("Error: invalid input range %d .. %d (source max %u)", options->inMin, options->inMax, srcMax);
+		return(-1);
+	}
+	if(options->deadzone<0 || 2*options->deadzone>=((options->inMax<0)?srcMax:options->inMax)-options->inMin){
+		errormessage("Error: deadzone must be positive and less than half the input range");
+		return(-1);
+	}
 	
 	if(verbose){
 		switch (destType){
@@ -228,46 +977,355 @@ int setMidiMap(struct MidiMap *map, const enum MapType destType, const unsigned
 				destValFrom-8192, destValTo-8192, destValFrom, destValTo);
 			break;
 	    case AT:
+	    case PAT:
 			printf(" to %s values from %ld to %ld\n", mapNames[destType], destValFrom, destValTo);
 			break;
 		default:
 			printf(" to %s %u (0x%02x) values from %ld to %ld\n", mapNames[destType],
 				destNum, destNum, destValFrom, destValTo);
 		}
+		if(options->deadband || options->hysteresis){
+			printf("  input deadband %d, hysteresis %d\n", options->deadband, options->hysteresis);
+		}
+		if(options->pickup>=0){
+			printf("  soft takeover, window %d\n", options->pickup);
+		}
+		if(options->dataEntry==DATA_INC){
+			printf("  data increment/decrement up to %d steps\n", options->incMax);
+		}else if(options->dataEntry!=DATA_BOTH){
+			printf("  data entry %s only, 7-bit value\n", dataEntryNames[options->dataEntry]);
+		}
+		if(options->inMin || options->inMax>=0){
+			printf("  input range %d to %d\n", options->inMin, (options->inMax<0)?srcMax:options->inMax);
+		}
+		if(options->deadzone) printf("  deadzone %d around middle\n", options->deadzone);
+		if(options->invert) printf("  inverted\n");
+		switch(options->curve){
+			case CURVE_LINEAR:
+				break;
+			case CURVE_GAMMA:
+				printf("  gamma %g curve\n", options->shape);
+				break;
+			case CURVE_POINTS:
+				printf("  curve through");
+				for(int p=0; p<options->pointCount; p++) printf(" %u%%:%u%%", options->points[p][0], options->points[p][1]);
+				printf("\n");
+				break;
+			default:
+				printf("  %s curve, shape %g\n", curveNames[options->curve], options->shape);
+		}
 	}
 	
-	map->type=destType;
-	map->num=destNum;
-	map->valFrom=destValFrom;
-	map->valTo=destValTo;
+	if(map->destCount==0) clearMidiMap(map); // New source
+	if(!map->state) map->state=addMapStates(1);
+	dest=&map->dest[d];
+	// A replaced destination leaves its table to the new one when the size matches
+	reuse=(d<map->destCount && dest->curve>=0 && dest->srcMax==srcMax)?dest->curve:-1;
+	dest->type=destType;
+	dest->num=destNum;
+	dest->valFrom=destValFrom;
+	dest->valTo=destValTo;
+	dest->options=*options;
+	dest->srcMax=srcMax;
+	dest->curve=needCurveTable(options)?addCurveTable(dest, srcMax, reuse):-1;
+	buildTemplate(dest);
+	if(!dest->state) dest->state=addDestStates(1);
+	resetDestState(destState(dest));
+	dest->out=outStateOf(destType, destNum);
+	if(d==map->destCount) map->destCount++;
+	linkOutStates(map);
 	return(0);
 }
 
-int setCcMap(const enum MapType m, const unsigned ccNum, const unsigned destNum, const long destValFrom, const long destValTo){
+// Unmap the 14-bit pair a cc belongs to
+void clearCcPair(const unsigned ccNum){
+	unsigned msbNum=(editBank->ccMaps[ccNum].hiRes==HIRES_MSB)?ccNum:editBank->ccMaps[ccNum].pairNum;
+	unsigned lsbNum=editBank->ccMaps[msbNum].pairNum;
+	errormessage("Warning: new mapping overrides 14-bit CC %u/%u", msbNum, lsbNum);
+	clearMidiMap(&editBank->ccMaps[msbNum]);
+	clearMidiMap(&editBank->ccMaps[lsbNum]);
+}
+
+int setCcMap(const enum MapType m, const unsigned ccNum, const unsigned destNum, const long destValFrom, const long destValTo, const struct MapOptions *options){
 	if (ccNum>=map_size){
 		errormessage("Error: invalid source controller number %u", ccNum);
 		return(-1);
 	}
+	if(editBank->ccMaps[ccNum].hiRes!=HIRES_NONE){
+		// Mapping either half on its own breaks the pair
+		clearCcPair(ccNum);
+	}else if(editBank->ccMaps[ccNum].relative!=REL_NONE){
+		errormessage("Warning: new mapping overrides relative CC %u", ccNum);
+		clearMidiMap(&editBank->ccMaps[ccNum]);
+	}
 	if(verbose) printf("CC %u (0x%02x)", ccNum, ccNum);
-	return(setMidiMap(&ccMaps[ccNum], m, destNum, destValFrom, destValTo));
+	return(setMidiMap(&editBank->ccMaps[ccNum], mapToMax[CC], m, destNum, destValFrom, destValTo, options));
+}
+
+// Map a relative encoder cc
+// Its position is kept per channel with 14-bit resolution,
+// and sent like a 14-bit source.
+int setRelMap(const enum MapType m, const unsigned ccNum, const unsigned destNum, const long destValFrom, const long destValTo, const struct MapOptions *options){
+	struct MidiMap *map;
+	long step;
+	if (options==NULL) options=&defaultOptions;
+	if (ccNum>=map_size){
+		errormessage("Error: invalid source controller number %u", ccNum);
+		return(-1);
+	}
+	if (options->encoding==REL_NONE || options->step<1 || options->step>16383){
+		errormessage("Error: invalid relative encoder setting");
+		return(-1);
+	}
+	if (options->accel<=0 || options->accel>4){
+		errormessage("Error: accel %g out of range, above 0 and at most 4", options->accel);
+		return(-1);
+	}
+	if (options->pickup>=0){
+		errormessage("Error: pickup does not apply to relative encoders");
+		return(-1);
+	}
+	map=&editBank->ccMaps[ccNum];
+	if(map->hiRes!=HIRES_NONE){
+		clearCcPair(ccNum);
+	}else if(map->destCount && map->relative==REL_NONE){
+		errormessage("Warning: relative CC %u overrides absolute mapping", ccNum);
+		clearMidiMap(map);
+	}
+	if(verbose) printf("REL %u (0x%02x) %s, step %d, accel %g", ccNum, ccNum, relativeNames[options->encoding], options->step, options->accel);
+	if(setMidiMap(map, mapToMax[CC14], m, destNum, destValFrom, destValTo, options)) return(-1);
+	map->relative=options->encoding;
+	for(int n=0; n<=64; n++){
+		step=lround(fmin(options->step*pow(n, options->accel), 16383)); // Clamped before lround, long may be 32-bit
+		map->relStep[n]=step;
+	}
+	return(0);
+}
+
+// Register a map with 14-bit source for LSB timeout handling
+void addHiResMap(struct MidiMap *map){
+	for(int i=0; i<port->hiResCount; i++){
+		if(port->hiResMaps[i]==map) return;
+	}
+	port->hiResMaps=realloc(port->hiResMaps, (port->hiResCount+1)*sizeof(*port->hiResMaps));
+	if(port->hiResMaps==NULL){
+		errormessage("Error: out of memory");
+		exit(-1);
+	}
+	port->hiResMaps[port->hiResCount++]=map;
+}
+
+// Map a pair of controllers, usually msbNum 0..31 and lsbNum=msbNum+32
+// Other pairs are two unrelated knobs, coarse and fine: MSB changes
+// keep the LSB and are sent right away.
+// The mapping is held by the MSB, the LSB only refers to it
+int setCc14Map(const enum MapType m, const unsigned msbNum, const unsigned lsbNum, const unsigned destNum, const long destValFrom, const long destValTo, const struct MapOptions *options){
+	const unsigned pair[]={msbNum, lsbNum};
+	if (options==NULL) options=&defaultOptions;
+	if (msbNum>=map_size || lsbNum>=map_size || msbNum==lsbNum){
+		errormessage("Error: invalid source controller pair %u/%u", msbNum, lsbNum);
+		return(-1);
+	}
+	if (options->lsbTimeout<0){
+		errormessage("Error: lsbtimeout must not be negative");
+		return(-1);
+	}
+	if(editBank->ccMaps[msbNum].hiRes!=HIRES_MSB || editBank->ccMaps[msbNum].pairNum!=lsbNum){ // New pair
+		for(int h=0; h<2; h++){
+			if(editBank->ccMaps[pair[h]].hiRes!=HIRES_NONE){
+				clearCcPair(pair[h]);
+			}else if(editBank->ccMaps[pair[h]].destCount){
+				errormessage("Warning: 14-bit CC %u/%u overrides mapping of CC %u", msbNum, lsbNum, pair[h]);
+				clearMidiMap(&editBank->ccMaps[pair[h]]);
+			}
+		}
+	}
+	if(verbose) printf("CC14 %u/%u (0x%02x/0x%02x)", msbNum, lsbNum, msbNum, lsbNum);
+	if(setMidiMap(&editBank->ccMaps[msbNum], mapToMax[CC14], m, destNum, destValFrom, destValTo, options)) return(-1);
+	editBank->ccMaps[msbNum].hiRes=HIRES_MSB;
+	editBank->ccMaps[msbNum].pairNum=lsbNum;
+	editBank->ccMaps[msbNum].independent=(lsbNum!=msbNum+32);
+	editBank->ccMaps[msbNum].lsbTimeout=options->lsbTimeout;
+	editBank->ccMaps[lsbNum].hiRes=HIRES_LSB;
+	editBank->ccMaps[lsbNum].pairNum=msbNum;
+	addHiResMap(&editBank->ccMaps[msbNum]);
+	return(0);
+}
+
+// Map of an incoming NRPN or RPN in a bank of the current port, NULL if none
+struct MidiMap *findParmMap(const struct MapBank *b, const int rpn, const unsigned parmNum){
+	int page=b->parmPages[rpn][parmNum>>7];
+	int m=page?port->parmPages[page-1][parmNum&0x7F]:0;
+	return(m?port->parmMaps[m-1]:NULL);
+}
+
+// Map an incoming NRPN or RPN, srcType is NRPN or RPN
+int setParmMap(const enum MapType srcType, const unsigned parmNum, const enum MapType m, const unsigned destNum, const long destValFrom, const long destValTo, const struct MapOptions *options){
+	int rpn=(srcType==RPN);
+	int *page;
+	struct MidiMap *map;
+	if (options==NULL) options=&defaultOptions;
+	if (parmNum>mapNumMax[srcType]){
+		errormessage("Error: invalid source parameter number %u", parmNum);
+		return(-1);
+	}
+	if (rpn && parmNum==0x3FFF){
+		errormessage("Error: RPN 16383 is the null parameter, it cannot be mapped");
+		return(-1);
+	}
+	if (options->lsbTimeout<0){
+		errormessage("Error: lsbtimeout must not be negative");
+		return(-1);
+	}
+	if(editBank->parmPages[rpn][parmNum>>7]==0){
+		if(port->poolsMapped) copyPools();
+		port->parmPages=realloc(port->parmPages, (port->pageCount+1)*sizeof(*port->parmPages));
+		if(port->parmPages==NULL){
+			errormessage("Error: out of memory");
+			exit(-1);
+		}
+		memset(port->parmPages[port->pageCount], 0, sizeof(*port->parmPages));
+		editBank->parmPages[rpn][parmNum>>7]=++port->pageCount;
+	}
+	page=port->parmPages[editBank->parmPages[rpn][parmNum>>7]-1];
+	if(page[parmNum&0x7F]==0){
+		port->parmMaps=realloc(port->parmMaps, (port->parmCount+1)*sizeof(*port->parmMaps));
+		if(port->parmMaps) port->parmMaps[port->parmCount]=calloc(1, sizeof(struct MidiMap));
+		if(port->parmMaps==NULL || port->parmMaps[port->parmCount]==NULL){
+			errormessage("Error: out of memory");
+			exit(-1);
+		}
+		page[parmNum&0x7F]=++port->parmCount;
+	}
+	map=port->parmMaps[page[parmNum&0x7F]-1];
+	if(verbose) printf("%s %u (0x%04x)", mapNames[srcType], parmNum, parmNum);
+	if(setMidiMap(map, mapToMax[srcType], m, destNum, destValFrom, destValTo, options)) return(-1);
+	map->hiRes=HIRES_MSB;
+	map->lsbTimeout=options->lsbTimeout;
+	addHiResMap(map);
+	editBank->parmDecode=1;
+	return(0);
+}
+
+// Controllers consumed by NRPN/RPN decoding
+int isParmCc(const unsigned char ccNum){
+	switch(ccNum){
+		case 6: case 38: // Data entry MSB, LSB
+		case 96: case 97: // Data increment, decrement
+		case 98: case 99: // NRPN LSB, MSB
+		case 100: case 101: // RPN LSB, MSB
+			return(1);
+		default:
+			return(0);
+	}
 }
 
-int setAtMap(const enum MapType m, const unsigned destNum, const long destValFrom, const long destValTo){
+int setAtMap(const enum MapType m, const unsigned destNum, const long destValFrom, const long destValTo, const struct MapOptions *options){
 	if(verbose) printf("Aftertouch");
-	return(setMidiMap(&atMap, m, destNum, destValFrom, destValTo));
+	return(setMidiMap(&editBank->atMap, mapToMax[AT], m, destNum, destValFrom, destValTo, options));
 }
 
-int setPbMap(const enum MapType m, const unsigned destNum, const long destValFrom, const long destValTo){
+int setPbMap(const enum MapType m, const unsigned destNum, const long destValFrom, const long destValTo, const struct MapOptions *options){
 	if(verbose) printf("Pitch bend");
-	return(setMidiMap(&pbMap, m, destNum, destValFrom, destValTo));
+	return(setMidiMap(&editBank->pbMap, mapToMax[PB], m, destNum, destValFrom, destValTo, options));
+}
+
+// Poly aftertouch to poly aftertouch keeps the note,
+// to any other destination the pressure of all notes is collapsed
+int setPatMap(const enum MapType m, const unsigned destNum, const long destValFrom, const long destValTo, const struct MapOptions *options){
+	if (options==NULL) options=&defaultOptions;
+	if(verbose) printf("Poly aftertouch");
+	if(verbose && m!=PAT && m!=NONE) printf(" (%s)", collapseNames[options->collapse]);
+	return(setMidiMap(&editBank->patMap, mapToMax[PAT], m, destNum, destValFrom, destValTo, options));
+}
+
+// Pitch bend or pressure on MPE member channels
+int setMpeMap(const enum MapType srcType, const enum MapType m, const unsigned destNum, const long destValFrom, const long destValTo, const struct MapOptions *options){
+	if(verbose) printf("MPE member %s", (srcType==PB)?"pitch bend":"pressure");
+	return(setMidiMap((srcType==PB)?&editBank->mpePbMap:&editBank->mpeAtMap, mapToMax[srcType], m, destNum, destValFrom, destValTo, options));
+}
+
+// Set MPE zones and member channels
+// Returns 0 on success, -1 if zones overlap
+int mpeValid(const struct MpeConfig *config){
+	return(config->lower>=0 && config->upper>=0 && config->rate>=0 && config->lower<=15 && config->upper<=15
+		&& !(config->lower && config->upper && config->lower+config->upper>14));
+}
+
+int setMpeZones(const struct MpeConfig *config){
+	if(!mpeValid(config)) return(-1);
+	port->mpe=*config;
+	for(int c=0; c<16; c++){
+		port->mpeMember[c]=(c>=1 && c<=port->mpe.lower) || (c<=14 && c>=15-port->mpe.upper);
+	}
+	return(0);
 }
 
-int init_maps(){
+// Find a bank by name, creating an empty one if needed
+struct MapBank *getBank(const char *name){
+	struct MapBank *b;
+	for(int i=0; i<port->bankCount; i++){
+		if(strcmp(port->banks[i]->name, name)==0) return(port->banks[i]);
+	}
+	if(port->bankCount==max_banks){
+		errormessage("Error: too many banks (max %d)", max_banks);
+		exit(-1);
+	}
+	b=calloc(1, sizeof(struct MapBank));
+	if(b==NULL){
+		errormessage("Error: out of memory");
+		exit(-1);
+	}
+	snprintf(b->name, sizeof(b->name), "%s", name);
 	for(int i=0; i<map_size; i++){
-		setCcMap(NONE, i, 0, mapToMin[CC], mapToMax[CC]);
+		clearMidiMap(&b->ccMaps[i]);
+	}
+	clearMidiMap(&b->atMap);
+	clearMidiMap(&b->pbMap);
+	clearMidiMap(&b->patMap);
+	clearMidiMap(&b->mpePbMap);
+	clearMidiMap(&b->mpeAtMap);
+	if(verbose) printf("Bank %d: %s\n", port->bankCount, b->name);
+	port->banks[port->bankCount++]=b;
+	return(b);
+}
+
+void selectBank(const unsigned index){
+	if(index>=port->bankCount){
+		if(verbose) printf("\nNo bank %u\n", index);
+		return;
+	}
+	if(port->bank!=port->banks[index]) port->bankSwitches++;
+	port->bank=port->banks[index];
+	if(verbose) printf("\nBank %u: %s\n", index, port->bank->name);
+}
+
+// Deadband and hysteresis filter, applied to input values before scaling
+// Returns 1 if the value should be processed, 0 if it should be dropped
+// Changes of deadband steps or less from the last accepted value are ignored,
+// a change of direction needs at least hysteresis steps.
+// Input range ends are always let through so that they can be reached.
+int filterInput(const struct MidiDest *dest, const unsigned char channel, const unsigned int val, const unsigned int max){
+	struct DestState *st;
+	int delta, dir, need;
+	if(dest->options.deadband==0 && dest->options.hysteresis==0) return(1);
+	st=destState(dest);
+	if(st->lastIn[channel]>=0){
+		delta=(int)val-st->lastIn[channel];
+		if(delta==0) return(0);
+		dir=(delta>0)?1:-1;
+		need=dest->options.deadband+1;
+		if(dir!=st->lastDir[channel] && st->lastDir[channel]!=0 && dest->options.hysteresis>need){
+			need=dest->options.hysteresis;
+		}
+		if(abs(delta)<need && val!=0 && val!=max){
+			if(verbose>1) printf("~");
+			return(0);
+		}
+		st->lastDir[channel]=dir;
 	}
-	setAtMap(NONE, 0, mapToMin[AT], mapToMax[AT]);
-	setPbMap(NONE, 0, mapToMin[PB], mapToMax[PB]);
+	st->lastIn[channel]=val;
+	return(1);
 }
 
 void dump(const unsigned char *buffer, const int count) {
@@ -279,274 +1337,2697 @@ void dump(const unsigned char *buffer, const int count) {
 	fflush(stdout);
 }
 
-void midiSend(snd_rawmidi_t* midiout, const char *outBuffer, const unsigned int count, unsigned char *status){
+void midiFlush(struct MidiOut *out){
 	int writeStatus;
-	if ((writeStatus = snd_rawmidi_write(midiout, outBuffer, count)) < 0) {
+	if(out->count==0) return;
+#ifdef HAVE_UMP
+	if(out->ump) writeStatus = snd_ump_write(out->ump, out->buffer, out->count);
+	else
+#endif
+	if(out->handle) writeStatus = snd_rawmidi_write(out->handle, out->buffer, out->count);
+	else if(out->fd>=0) writeStatus = (write(out->fd, out->buffer, out->count)<0)?-errno:0;
+	else writeStatus = 0;
+	if (writeStatus < 0) {
 		errormessage("Problem writing MIDI Output: %s", snd_strerror(writeStatus));
 		exit(-1);
 	};
-	if(status){ // Update output status
-		// We know that in this application the status is in outBuffer[0]
-		// but the loop keeps the function more generic
-		for(int i=count-1; i>=0; i--){
-			if (outBuffer[i] & 0x80){
-				*status=outBuffer[i];
-				break;
-			}
-		}
+	out->count=0;
+}
+
+// Number of data bytes following a status, -1 for sysex
+int midiDataLength(const unsigned char status){
+	const int channelLength[]={2, 2, 2, 2, 1, 1, 2};
+	if(status<0x80) return(0);
+	if(status<0xF0) return(channelLength[(status>>4)-8]);
+	switch(status){
+		case 0xF0: return(-1);
+		case 0xF1:
+		case 0xF3: return(1);
+		case 0xF2: return(2);
+		default: return(0);
 	}
+}
+
+// Queue UMP words for output, they are written by midiFlush
+void umpSend(struct MidiOut *out, const uint32_t *words, const unsigned int count){
+	if(out->count+count*sizeof(*words)>sizeof(out->buffer)){
+		midiFlush(out);
+	}
+	memcpy(out->buffer+out->count, words, count*sizeof(*words));
+	out->count+=count*sizeof(*words);
 	if(verbose>1){
-		printf(" --> ");
-		dump(outBuffer, count);
+		printf(" ==>");
+		for(int i=0; i<count; i++) printf(" %08x", words[i]);
+		fflush(stdout);
 	}
 }
 
-void midiSendParm(snd_rawmidi_t *midiout, unsigned char *outBuffer, unsigned char *runningStatusOut, const unsigned char channel, const struct MidiMap *map, const unsigned int val, const unsigned int max){
-	int parmVal;
-	unsigned char newStatusOut;
-	int k=0;
-	if(verbose>1) printf((map->type == RPN)?"R":"N");
-	parmVal=map->valFrom+val*(map->valTo-map->valFrom)/max;
-	// see https://www.midi.org/specifications-old/item/table-3-control-change-messages-data-bytes-2
-	if (parmVal<0) parmVal=0;
-	if (parmVal>16383) parmVal=16383;
-	newStatusOut=0xB0+channel;
-	if(newStatusOut!=*runningStatusOut){
-		outBuffer[k++]=newStatusOut;
-	}
-	outBuffer[k++]=(map->type == RPN)?0x65:0x63;
-	outBuffer[k++]=(map->num>>7)&0x7F;
-	outBuffer[k++]=(map->type == RPN)?0x64:0x62;
-	outBuffer[k++]=map->num&0x7F;
-	outBuffer[k++]=0x06; // Data entry MSB
-	outBuffer[k++]=(parmVal>>7)&0x7F;
-	outBuffer[k++]=0x26; // Data entry LSB
-	outBuffer[k++]=parmVal&0x7F;
-	// The following prevent accidental change of NRPN value
-	outBuffer[k++]=0x65; // RPN MSB
-	outBuffer[k++]=0x7F;
-	outBuffer[k++]=0x64; // RPN LSB
-	outBuffer[k++]=0x7F;
-	midiSend(midiout, outBuffer, k, runningStatusOut);
+// Send sysex data held in umpMsg as one 7-bit sysex packet
+// Packet status: 0 complete, 1 start, 2 continue, 3 end
+void umpSysex(struct MidiOut *out, const int last){
+	uint32_t words[2];
+	unsigned char d[6]={0};
+	int status=out->umpSysexStarted?(last?3:2):(last?0:1);
+	memcpy(d, out->umpMsg, out->umpLen);
+	words[0]=0x30000000 | (ump_group<<24) | (status<<20) | (out->umpLen<<16) | (d[0]<<8) | d[1];
+	words[1]=(d[2]<<24) | (d[3]<<16) | (d[4]<<8) | d[5];
+	umpSend(out, words, 2);
+	out->umpSysexStarted=!last;
+	out->umpLen=0;
 }
 
-void midiSendCc(snd_rawmidi_t* midiout, unsigned char *outBuffer, unsigned char *runningStatusOut, const unsigned char channel, const struct MidiMap *map, const unsigned int val, const unsigned int max){
-	unsigned char ccVal;
-	unsigned char newStatusOut;
-	int k=0;
-	if(verbose>1) printf("C");
-	ccVal=map->valFrom+val*(map->valTo-map->valFrom)/max;
-	if (ccVal<0) ccVal=0;
-	if (ccVal>127) ccVal=127;
-	newStatusOut=0xB0+channel;
-	if(newStatusOut!=*runningStatusOut){
-		outBuffer[k++]=newStatusOut;
+// Convert MIDI 1.0 bytes to UMP, with running status
+// Channel messages become MIDI 1.0 channel voice packets
+void umpConvert(struct MidiOut *out, const unsigned char *bytes, const unsigned int count){
+	uint32_t word;
+	for(int i=0; i<count; i++){
+		unsigned char b=bytes[i];
+		if(b>=0xF8){ // Real time
+			word=0x10000000 | (ump_group<<24) | (b<<16);
+			umpSend(out, &word, 1);
+			continue;
+		}
+		if(b&0x80){
+			if(out->umpNeed<0){ // End of sysex, F7 or any other status
+				umpSysex(out, 1);
+				out->umpNeed=0;
+				if(b==0xF7) continue;
+			}
+			if(b==0xF7){ // End of sysex outside a sysex, no UMP packet carries it
+				out->umpLen=0;
+				continue;
+			}
+			if(b==0xF0){
+				out->umpNeed=-1;
+				out->umpLen=0;
+				out->umpSysexStarted=0;
+				continue;
+			}
+			out->umpMsg[0]=b;
+			out->umpLen=1;
+			out->umpNeed=1+midiDataLength(b);
+		}else if(out->umpNeed<0){
+			if(out->umpLen==6) umpSysex(out, 0);
+			out->umpMsg[out->umpLen++]=b;
+			continue;
+		}else{
+			if(out->umpLen==0) continue; // No status yet
+			if(out->umpLen==out->umpNeed) out->umpLen=1; // Running status
+			out->umpMsg[out->umpLen++]=b;
+		}
+		if(out->umpLen==out->umpNeed){
+			word=((out->umpMsg[0]<0xF0)?0x20000000:0x10000000) | (ump_group<<24) | (out->umpMsg[0]<<16);
+			if(out->umpLen>1) word|=out->umpMsg[1]<<8;
+			if(out->umpLen>2) word|=out->umpMsg[2];
+			umpSend(out, &word, 1);
+			if(out->umpMsg[0]>=0xF0) out->umpLen=0; // System common has no running status
+		}
 	}
-	outBuffer[k++]=map->num;
-	outBuffer[k++]=ccVal;
-	midiSend(midiout, outBuffer, k, runningStatusOut);
 }
 
-void midiSendPb(snd_rawmidi_t* midiout, unsigned char *outBuffer, unsigned char *runningStatusOut, const unsigned char channel, const struct MidiMap *map, const unsigned int val, const unsigned int max){
-	long pbVal;
-	unsigned char newStatusOut;
-	int k=0;
-	if(verbose>1) printf("P");
-	pbVal=map->valFrom+((long)val*(map->valTo-map->valFrom))/max;
-	if (pbVal<0) pbVal=0;
-	if (pbVal>16383) pbVal=16383;
-	k=0;
-	newStatusOut=0xE0+channel;
-	if(newStatusOut!=*runningStatusOut){
-		outBuffer[k++]=newStatusOut;
-	}
-	outBuffer[k++]=pbVal & 0x7F;
-	outBuffer[k++]=(pbVal >>7) & 0x7F;
-	// At this stage output running status is E0+channel
-	// while input running status could be B0 (or D0) +channel
-	// We will echo the input running status after sending the pitch bend
-	// or not depending on what follows in the output stream
-	// This is handled through runningStatusOut/newStatusOut
-	midiSend(midiout, outBuffer, k, runningStatusOut);
-}
-
-void midiSendAt(snd_rawmidi_t* midiout, unsigned char *outBuffer, unsigned char *runningStatusOut, const unsigned char channel, const struct MidiMap *map, const unsigned int val, const unsigned int max){
-	long atVal;
-	unsigned char newStatusOut;
-	int k=0;
-	if(verbose>1) printf("A");
-	atVal=map->valFrom+((long)val*(map->valTo-map->valFrom))/max;
-	if (atVal<0) atVal=0;
-	if (atVal>127) atVal=127;
-	k=0;
-	newStatusOut=0xD0+channel;
-	if(newStatusOut!=*runningStatusOut){
-		outBuffer[k++]=newStatusOut;
-	}
-	outBuffer[k++]=atVal & 0x7F;
-	// At this stage output running status is D0+channel
-	// while input running status could be B0 (or D0) +channel
-	// We will echo the input running status after sending the aftertouch
-	// or not depending on what follows in the output stream
-	// This is handled through runningStatusOut/newStatusOut
-	midiSend(midiout, outBuffer, k, runningStatusOut);
+void midiSend(struct MidiOut *out, const unsigned char *outBuffer, const unsigned int count);
+
+// End of the sysex being sent on an output, messages held back meanwhile are sent
+void midiSysexEnd(struct MidiOut *out){
+	int count=out->heldCount;
+	out->sysexPort=NULL;
+	out->heldFull=0;
+	if(count==0) return;
+	if(verbose>1) printf(" (held)");
+	out->heldCount=0;
+	midiSend(out, out->held, count);
+	if(out->sysexPort) out->sysexPort=out->heldSysexPort; // Held messages started a sysex
 }
 
-void readIniFile(const char *filename){
+// Queue bytes for output, they are written by midiFlush
+void midiSend(struct MidiOut *out, const unsigned char *outBuffer, const unsigned int count){
+	if(out->sysexPort && out->sysexPort!=port && !(count==1 && outBuffer[0]>=0xF8)){
+		// Another port is in the middle of a sysex, hold back until it ends
+		// Held messages do not change running status, they always have their status byte
+		if(out->heldCount+count>sizeof(out->held)){
+			if(verbose>1) printf(" (dropped)");
+			port->heldDropped+=count;
+			if(!out->heldFull) errormessage("Warning: port %s output dropped while port %s sends a sysex", port->name, out->sysexPort->name);
+			out->heldFull=1;
+			return;
+		}
+		memcpy(out->held+out->heldCount, outBuffer, count);
+		out->heldCount+=count;
+		for(int i=0; i<count; i++){
+			if((outBuffer[i] & 0x80) && outBuffer[i]<0xF8) out->heldSysexPort=(outBuffer[i]==0xF0)?port:NULL;
+		}
+		return;
+	}
+	if(out->umpOut){
+		umpConvert(out, outBuffer, count);
+	}else{
+		if(out->count+count>sizeof(out->buffer)){
+			midiFlush(out);
+		}
+		memcpy(out->buffer+out->count, outBuffer, count);
+		out->count+=count;
+	}
+	// Update output status
+	// We know that in this application the status is in outBuffer[0]
+	// but the loop keeps the function more generic
+	// Real time messages do not affect running status
+	for(int i=0; i<count; i++){
+		if ((outBuffer[i] & 0x80) && outBuffer[i]<0xF8){
+			out->runningStatus=outBuffer[i];
+			out->sysexPort=(outBuffer[i]==0xF0)?port:NULL;
+		}
+	}
+	if(verbose>1){
+		printf(" --> ");
+		dump(outBuffer, count);
+	}
+	if(!out->sysexPort && out->heldCount) midiSysexEnd(out);
+}
+
+// Queue a complete message, its status is left out if it is the running status of the output
+void midiSendMessage(struct MidiOut *out, const unsigned char *msg, const unsigned int len){
+	if(msg[0]==out->runningStatus && msg[0]<0xF0){
+		if(verbose>1) printf("s");
+		midiSend(out, msg+1, len-1);
+	}else{
+		midiSend(out, msg, len);
+	}
+}
+
+// Output for a message of the current port, out if no route matches
+// Channel is -1 for system messages, num is -1 for messages without number
+struct MidiOut *routeOut(struct MidiOut *out, const enum RouteType type, const int channel, const int num){
+	struct Route *r;
+	for(int n=0; n<port->routeCount; n++){
+		r=&port->routes[n];
+		if(r->type!=ROUTE_ANY && r->type!=type) continue;
+		if(r->channelFrom>=0 && (channel<r->channelFrom || channel>r->channelTo)) continue;
+		if(r->numFrom>=0 && (num<r->numFrom || num>r->numTo)) continue;
+		return(r->out);
+	}
+	return(out);
+}
+
+// Queue a complete message that is passed through, on the output of its route
+void passMessage(struct MidiOut *out, const unsigned char *msg, const unsigned int len){
+	int channel=(msg[0]<0xF0)?(msg[0]&0x0F):-1;
+	int num=(len>1 && msg[0]<0xD0)?msg[1]:-1; // Note, controller or program
+	if(port->routeCount) out=routeOut(out, routeOfStatus[(msg[0]>>4)&7], channel, num);
+	midiSendMessage(out, msg, len);
+}
+
+// Decode one UMP packet to MIDI 1.0 bytes, appended at bytes[k]
+// MIDI 2.0 channel voice values are reduced as per MIDI 2.0 (most
+// significant bits), those that can be mapped also keep their 32-bit value.
+// Returns the new byte count
+int umpDecode(struct UmpIn *in, const uint32_t w0, const uint32_t w1, unsigned char *bytes, int k){
+	unsigned char status=(w0>>16)&0xFF, channel=(w0>>16)&0x0F;
+	unsigned char sysex[6];
+	int start=k, len, rpn;
+	switch(w0>>28){
+		case 0x1: // System real time and common
+			bytes[k++]=status;
+			len=midiDataLength(status);
+			if(len>0) bytes[k++]=(w0>>8)&0x7F;
+			if(len>1) bytes[k++]=w0&0x7F;
+			break;
+		case 0x2: // MIDI 1.0 channel voice
+			bytes[k++]=status;
+			bytes[k++]=(w0>>8)&0x7F;
+			if(midiDataLength(status)>1) bytes[k++]=w0&0x7F;
+			break;
+		case 0x3: // 7-bit sysex, status 0 complete, 1 start, 2 continue, 3 end
+			len=(w0>>16)&0x0F;
+			if(len>6) len=6;
+			sysex[0]=(w0>>8)&0x7F;
+			sysex[1]=w0&0x7F;
+			for(int j=2; j<6; j++) sysex[j]=(w1>>(8*(5-j)))&0x7F;
+			if(((w0>>20)&0x0F)<2) bytes[k++]=0xF0;
+			memcpy(bytes+k, sysex, len);
+			k+=len;
+			if(((w0>>20)&0x0F)==0 || ((w0>>20)&0x0F)==3) bytes[k++]=0xF7;
+			break;
+		case 0x4: // MIDI 2.0 channel voice
+			switch(status&0xF0){
+				case 0x80:
+				case 0x90:
+				case 0xA0:
+					bytes[k++]=status;
+					bytes[k++]=(w0>>8)&0x7F;
+					bytes[k++]=w1>>25;
+					// Velocity 0 would be a note off
+					if((status&0xF0)==0x90 && bytes[k-1]==0) bytes[k-1]=1;
+					break;
+				case 0xB0:
+					bytes[k++]=status;
+					bytes[k++]=(w0>>8)&0x7F;
+					bytes[k++]=w1>>25;
+					break;
+				case 0xC0:
+					if(w0&1){ // Bank valid
+						bytes[k++]=0xB0+channel;
+						bytes[k++]=0;
+						bytes[k++]=(w1>>8)&0x7F;
+						bytes[k++]=32;
+						bytes[k++]=w1&0x7F;
+					}
+					bytes[k++]=status;
+					bytes[k++]=(w1>>24)&0x7F;
+					break;
+				case 0xD0:
+					bytes[k++]=status;
+					bytes[k++]=w1>>25;
+					break;
+				case 0xE0:
+					bytes[k++]=status;
+					bytes[k++]=(w1>>18)&0x7F;
+					bytes[k++]=w1>>25;
+					break;
+				case 0x20: // Registered controller
+				case 0x30: // Assignable controller
+					rpn=(status&0xF0)==0x20;
+					bytes[k++]=0xB0+channel;
+					bytes[k++]=rpn?101:99;
+					bytes[k++]=(w0>>8)&0x7F;
+					bytes[k++]=rpn?100:98;
+					bytes[k++]=w0&0x7F;
+					bytes[k++]=6;
+					bytes[k++]=w1>>25;
+					bytes[k++]=38;
+					bytes[k++]=(w1>>18)&0x7F;
+					break;
+				default:
+					// Per-note and relative controllers have no MIDI 1.0 equivalent
+					if(verbose>1) printf("!");
+			}
+			break;
+		// Utility, 8-bit sysex, flex data and stream packets are not passed on
+	}
+	memset(in->wideKind+start, WIDE_NONE, k-start);
+	if(k>start && (w0>>28)==0x4){
+		switch(status&0xF0){
+			case 0xB0:
+			case 0xD0:
+			case 0xE0:
+				in->wide[k-1]=w1;
+				in->wideKind[k-1]=WIDE_VALUE;
+				break;
+			case 0x20:
+			case 0x30:
+				in->wide[k-3]=in->wide[k-1]=w1;
+				in->wideKind[k-3]=WIDE_PARM_MSB;
+				in->wideKind[k-1]=WIDE_PARM_LSB;
+				break;
+		}
+	}
+	return(k);
+}
+
+// Read UMP input and decode the complete packets to MIDI 1.0 bytes
+// At most size/8 words are read, their bytes fit in size
+// Returns the number of bytes, or a negative error, -EAGAIN if there is nothing to parse
+int umpRead(struct UmpIn *in, unsigned char *bytes, const int size){
+	const int packetWords[]={1, 1, 1, 2, 2, 4, 1, 1, 2, 2, 2, 3, 3, 4, 4, 4}; // By message type
+	int readStatus, n, p=0, k=0;
+#ifdef HAVE_UMP
+	readStatus=snd_ump_read(in->handle, in->words+in->count, (size/8-in->count)*sizeof(*in->words));
+#else
+	readStatus=-ENODEV;
+#endif
+	if(readStatus<0) return(readStatus);
+	in->count+=readStatus/sizeof(*in->words);
+	while(p<in->count){
+		n=packetWords[in->words[p]>>28];
+		if(p+n>in->count) break; // Rest of packet comes with next read
+		k=umpDecode(in, in->words[p], (n>1)?in->words[p+1]:0, bytes, k);
+		p+=n;
+	}
+	memmove(in->words, in->words+p, (in->count-p)*sizeof(*in->words));
+	in->count-=p;
+	if(k==0) return(-EAGAIN);
+	return(k);
+}
+
+// Destination value for a source value, before clipping
+// Curved destinations have the scaled value in their table,
+// finer input (from 32-bit values) is reduced to one entry per source step
+long scaleValue(const struct MidiDest *dest, unsigned int val, const unsigned int max){
+	if(dest->curve>=0){
+		if(max!=dest->srcMax) val=(unsigned long long)val*dest->srcMax/max;
+		return(port->curveTables[dest->curve+val]);
+	}
+	return(dest->valFrom+((long)val*(dest->valTo-dest->valFrom))/max);
+}
+
+// Source value of a 32-bit input, with 16 fraction bits
+// Reverse of MIDI 2.0 min-center-max upscaling, so that the center
+// of the 32-bit range is the center of the source range.
+unsigned int wideSource(const uint32_t val, const unsigned int srcMax){
+	unsigned long long center=(srcMax+1)/2;
+	if(val<=0x80000000) return((val*center)>>15);
+	return((center<<16)+(val-0x80000000ULL)*((srcMax-center)<<16)/0x7FFFFFFF);
+}
+
+// Relative NRPN/RPN output, parameter is left selected so that
+// the next small change only costs data increment or decrement bytes.
+// Larger changes, or unknown previous value, are sent as data entry.
+// The previous value is the one of the parameter, whatever map sent it.
+// After a bank switch the first value is sent as data entry.
+void midiSendParmInc(struct MidiOut *out, const unsigned char channel, const struct MidiDest *dest, const int parmVal){
+	struct OutState *o=&port->outStates[dest->out-1];
+	int key=PARM_KEY(dest->type==RPN, dest->num);
+	int delta=(o->lastOut[channel]<0 || o->incSwitch[channel]!=port->bankSwitches)?16384:parmVal-o->lastOut[channel];
+	unsigned char outBuffer[5+2*63];
+	int k=0;
+	if(delta==0) return; // Receiver already has this value
+	if(0xB0+channel!=out->runningStatus){
+		outBuffer[k++]=0xB0+channel;
+	}
+	if(out->parmOut[channel]!=key){
+		outBuffer[k++]=(dest->type == RPN)?0x65:0x63;
+		outBuffer[k++]=(dest->num>>7)&0x7F;
+		outBuffer[k++]=(dest->type == RPN)?0x64:0x62;
+		outBuffer[k++]=dest->num&0x7F;
+		out->parmOut[channel]=key;
+	}
+	if(abs(delta)<=dest->options.incMax){
+		for(int n=0; n<abs(delta); n++){
+			outBuffer[k++]=(delta>0)?0x60:0x61; // Data increment, decrement
+			outBuffer[k++]=0;
+		}
+	}else{
+		outBuffer[k++]=0x06; // Data entry MSB
+		outBuffer[k++]=(parmVal>>7)&0x7F;
+		outBuffer[k++]=0x26; // Data entry LSB
+		outBuffer[k++]=parmVal&0x7F;
+	}
+	o->lastOut[channel]=parmVal;
+	o->incSwitch[channel]=port->bankSwitches;
+	midiSend(out, outBuffer, k);
+}
+
+// Destination value at 32-bit resolution, for MIDI 2.0 output
+// Linear scaling is done on the source value directly, curved
+// destinations use their table. MIDI 2.0 min-center-max upscaling
+// keeps the center of 7 and 14-bit ranges at 0x80000000.
+uint32_t scaleValue32(const struct MidiDest *dest, const unsigned int val, const unsigned int max){
+	double destMax=mapToMax[dest->type];
+	double center=(mapToMax[dest->type]+1)/2;
+	double d; // Destination value, with fraction
+	if(dest->curve>=0) d=scaleValue(dest, val, max);
+	else d=dest->valFrom+(double)val*(dest->valTo-dest->valFrom)/max;
+	if(d<0) d=0;
+	if(d>destMax) d=destMax;
+	if(d<=center) return(llround(d*0x80000000LL/center));
+	return(0x80000000LL+llround((d-center)*0x7FFFFFFFLL/(destMax-center)));
+}
+
+// One MIDI 2.0 channel voice packet per value
+// NRPN and RPN are assignable and registered controllers,
+// CC14 is sent as a 32-bit controller on its MSB number.
+void midiSendUmp(struct MidiOut *out, const unsigned char channel, const struct MidiDest *dest, const unsigned int note, const unsigned int val, const unsigned int max){
+	uint32_t words[2];
+	unsigned int opcode, index;
+	switch(dest->type){
+		case NRPN:
+		case RPN:
+			opcode=(dest->type==RPN)?0x2:0x3;
+			index=((dest->num>>7)<<8) | (dest->num&0x7F); // Bank, index
+			break;
+		case CC:
+		case CC14:
+			opcode=0xB;
+			index=dest->num<<8;
+			break;
+		case PB:
+			opcode=0xE;
+			index=0;
+			break;
+		case AT:
+			opcode=0xD;
+			index=0;
+			break;
+		case PAT:
+			opcode=0xA;
+			index=note<<8;
+			break;
+		default:
+			errormessage("Internal error - unexpected map type %u\n", dest->type);
+			exit(-1);
+	}
+	if(verbose>1) printf("U");
+	words[0]=0x40000000 | (ump_group<<24) | (opcode<<20) | (channel<<16) | index;
+	words[1]=scaleValue32(dest, val, max);
+	umpSend(out, words, 2);
+}
+
+// Queue the template message of a destination with value v, clipped to destination range
+// Note is only used by PAT
+void midiSendTemplate(struct MidiOut *out, const unsigned char channel, const struct MidiDest *dest, const unsigned char note, long v){
+	unsigned char outBuffer[max_template];
+	int skip;
+	if (v<0) v=0;
+	if (v>mapToMax[dest->type]) v=mapToMax[dest->type];
+	memcpy(outBuffer, dest->tmpl, dest->tmplLen);
+	outBuffer[0]|=channel;
+	if(dest->type==PAT) outBuffer[1]=note;
+	if(dest->tmplHi) outBuffer[dest->tmplHi]=(v>>7)&0x7F;
+	if(dest->tmplLo) outBuffer[dest->tmplLo]=v&0x7F;
+	// Output (running) status can be different from last input status
+	// This occurs when mapping cc to pitch bend, and when mapping from aftertouch
+	skip=(outBuffer[0]==out->runningStatus);
+	midiSend(out, outBuffer+skip, dest->tmplLen-skip);
+}
+
+void midiSendParm(struct MidiOut *out, const unsigned char channel, struct MidiDest *dest, const unsigned int val, const unsigned int max){
+	int parmVal;
+	if(verbose>1) printf((dest->type == RPN)?"R":"N");
+	parmVal=scaleValue(dest, val, max);
+	// see https://www.midi.org/specifications-old/item/table-3-control-change-messages-data-bytes-2
+	if (parmVal<0) parmVal=0;
+	if (parmVal>16383) parmVal=16383;
+	if(dest->options.dataEntry==DATA_INC){
+		midiSendParmInc(out, channel, dest, parmVal);
+		return;
+	}
+	// Receiver has the whole value only when both data entry bytes are sent
+	port->outStates[dest->out-1].lastOut[channel]=(dest->options.dataEntry==DATA_BOTH)?parmVal:-1;
+	port->outStates[dest->out-1].incSwitch[channel]=port->bankSwitches;
+	out->parmOut[channel]=PARM_NULL; // Template ends with reset
+	midiSendTemplate(out, channel, dest, 0, parmVal);
+}
+
+void midiSendCc(struct MidiOut *out, const unsigned char channel, const struct MidiDest *dest, const unsigned int val, const unsigned int max){
+	if(verbose>1) printf("C");
+	midiSendTemplate(out, channel, dest, 0, scaleValue(dest, val, max));
+}
+
+// High resolution cc pair, MSB on num, LSB on num+32
+void midiSendCc14(struct MidiOut *out, const unsigned char channel, const struct MidiDest *dest, const unsigned int val, const unsigned int max){
+	if(verbose>1) printf("W");
+	midiSendTemplate(out, channel, dest, 0, scaleValue(dest, val, max));
+}
+
+void midiSendPb(struct MidiOut *out, const unsigned char channel, const struct MidiDest *dest, const unsigned int val, const unsigned int max){
+	if(verbose>1) printf("P");
+	midiSendTemplate(out, channel, dest, 0, scaleValue(dest, val, max));
+}
+
+void midiSendAt(struct MidiOut *out, const unsigned char channel, const struct MidiDest *dest, const unsigned int val, const unsigned int max){
+	if(verbose>1) printf("A");
+	midiSendTemplate(out, channel, dest, 0, scaleValue(dest, val, max));
+}
+
+void midiSendPolyAt(struct MidiOut *out, const unsigned char channel, const unsigned char note, const struct MidiDest *dest, const unsigned int val){
+	if(port->routeCount) out=routeOut(out, ROUTE_PAT, channel, note);
+	if(out->umpOut){
+		midiSendUmp(out, channel, dest, note, val, mapToMax[PAT]);
+		return;
+	}
+	if(verbose>1) printf("Y");
+	midiSendTemplate(out, channel, dest, note, scaleValue(dest, val, mapToMax[PAT]));
+}
+
+// Parse one name=value mapping option, advancing *start past it
+// Returns 0 on success, -1 on unknown name or missing value
+int readMapOption(char **start, struct MapOptions *options){
+	char *tail;
+	long val;
+	int *field;
+	const char **words=NULL; // Allowed values for settings given as words
+	if (strncmp(*start, "gamma", 5)==0 || strncmp(*start, "shape", 5)==0 || strncmp(*start, "accel", 5)==0){
+		double *real=(**start=='a')?&options->accel:&options->shape;
+		if (**start=='g') options->curve=CURVE_GAMMA;
+		*start+=5;
+		while(**start==' ' || **start=='\t') (*start)++;
+		if (**start!='=') return(-1);
+		*real=strtod(*start+1, &tail);
+		if (tail==*start+1) return(-1);
+		*start=tail;
+		return(0);
+	}
+	if (strncmp(*start, "points", 6)==0){
+		// points=in:out/in:out... in percent, in increasing
+		*start+=6;
+		while(**start==' ' || **start=='\t') (*start)++;
+		if (**start!='=') return(-1);
+		options->pointCount=0;
+		do{
+			unsigned long x, y;
+			(*start)++;
+			if (options->pointCount==max_points) return(-1);
+			x=strtoul(*start, &tail, 0);
+			if (tail==*start || *tail!=':') return(-1);
+			*start=tail+1;
+			y=strtoul(*start, &tail, 0);
+			if (tail==*start || x>100 || y>100) return(-1);
+			if (options->pointCount && x<=options->points[options->pointCount-1][0]) return(-1);
+			options->points[options->pointCount][0]=x;
+			options->points[options->pointCount][1]=y;
+			options->pointCount++;
+			*start=tail;
+		}while(**start=='/');
+		if (options->pointCount<2) return(-1);
+		options->curve=CURVE_POINTS;
+		return(0);
+	}
+	if (strncmp(*start, "invert", 6)==0 && !isalnum((unsigned char)(*start)[6])){
+		// Flag, =0 or =1 is optional
+		*start+=6;
+		options->invert=1;
+		while(**start==' ' || **start=='\t') (*start)++;
+		if (**start!='=') return(0);
+		(*start)++;
+		while(**start==' ' || **start=='\t') (*start)++;
+		val=strtol(*start, &tail, 0);
+		if (tail==*start) return(-1);
+		options->invert=(val!=0);
+		*start=tail;
+		return(0);
+	}
+	if (strncmp(*start, "deadband", 8)==0){
+		field=&options->deadband;
+		*start+=8;
+	}else if (strncmp(*start, "hysteresis", 10)==0){
+		field=&options->hysteresis;
+		*start+=10;
+	}else if (strncmp(*start, "lsbtimeout", 10)==0){
+		field=&options->lsbTimeout;
+		*start+=10;
+	}else if (strncmp(*start, "pickup", 6)==0){
+		field=&options->pickup;
+		*start+=6;
+	}else if (strncmp(*start, "thin", 4)==0){
+		field=&options->thin;
+		*start+=4;
+	}else if (strncmp(*start, "collapse", 8)==0){
+		field=&options->collapse;
+		words=collapseNames;
+		*start+=8;
+	}else if (strncmp(*start, "incmax", 6)==0){
+		field=&options->incMax;
+		*start+=6;
+	}else if (strncmp(*start, "data", 4)==0){
+		field=&options->dataEntry;
+		words=dataEntryNames;
+		*start+=4;
+	}else if (strncmp(*start, "inmin", 5)==0){
+		field=&options->inMin;
+		*start+=5;
+	}else if (strncmp(*start, "inmax", 5)==0){
+		field=&options->inMax;
+		*start+=5;
+	}else if (strncmp(*start, "deadzone", 8)==0){
+		field=&options->deadzone;
+		*start+=8;
+	}else if (strncmp(*start, "encoding", 8)==0){
+		field=&options->encoding;
+		words=relativeNames;
+		*start+=8;
+	}else if (strncmp(*start, "step", 4)==0){
+		field=&options->step;
+		*start+=4;
+	}else if (strncmp(*start, "curve", 5)==0){
+		field=&options->curve;
+		words=curveNames;
+		*start+=5;
+	}else return(-1);
+	while(**start==' ' || **start=='\t') (*start)++;
+	if (**start!='=') return(-1);
+	(*start)++;
+	while(**start==' ' || **start=='\t') (*start)++;
+	if (words){
+		for(int n=0; words[n]; n++){
+			size_t len=strlen(words[n]);
+			if (strncmp(*start, words[n], len)==0 && !isalnum((unsigned char)(*start)[len])){
+				*field=n;
+				*start+=len;
+				return(0);
+			}
+		}
+		return(-1);
+	}
+	val=strtol(*start, &tail, 0);
+	if (tail==*start) return(-1);
+	*field=val;
+	*start=tail;
+	return(0);
+}
+
+// Send a value to one destination
+void midiSendDest(struct MidiOut *out, const unsigned char channel, struct MidiDest *dest, const unsigned int val, const unsigned int max){
+	if(port->routeCount) out=routeOut(out, routeOfMap[dest->type], channel, dest->num);
+	if(out->umpOut){
+		midiSendUmp(out, channel, dest, 0, val, max);
+		return;
+	}
+	switch (dest->type){
+		case CC:
+			midiSendCc(out, channel, dest, val, max);
+			break;
+		case CC14:
+			midiSendCc14(out, channel, dest, val, max);
+			break;
+		case RPN:
+		case NRPN:
+			midiSendParm(out, channel, dest, val, max);
+			break;
+		case PB:
+			midiSendPb(out, channel, dest, val, max);
+			break;
+		case AT:
+			midiSendAt(out, channel, dest, val, max);
+			break;
+		// PAT destinations need a note, they are sent by polyInput
+		default:
+			errormessage("Internal error - unexpected map type %u\n", dest->type);
+			exit(-1);
+	}
+}
+
+// Soft takeover
+// After a bank switch the physical control no longer matches the value
+// last sent to the output, by any bank. Output is held back until the control
+// crosses that value, or comes within the pickup window of it.
+// Values of all destinations sending to an output with soft takeover are recorded.
+// Returns 1 if the value should be sent, 0 if it should be dropped
+int pickupInput(const struct MidiDest *dest, const unsigned char channel, const unsigned int val, const unsigned int max){
+	struct OutState *o=&port->outStates[dest->out-1];
+	struct DestState *st;
+	long v, last, prev;
+	if(!o->pickup) return(1);
+	v=scaleValue(dest, val, max);
+	if (v<0) v=0;
+	if (v>mapToMax[dest->type]) v=mapToMax[dest->type];
+	last=o->pickupLast[channel];
+	if(dest->options.pickup>=0){
+		st=destState(dest);
+		if(st->pickupSwitch[channel]!=port->bankSwitches){
+			st->pickupSwitch[channel]=port->bankSwitches;
+			st->pickedUp[channel]=0;
+			st->pickupPrev[channel]=-1;
+		}
+		if(!st->pickedUp[channel] && last>=0){
+			prev=st->pickupPrev[channel];
+			st->pickupPrev[channel]=v;
+			if(labs(v-last)>dest->options.pickup && (prev<0 || (prev<last)==(v<last))){
+				if(verbose>1) printf("w");
+				return(0);
+			}
+		}
+		st->pickedUp[channel]=1;
+	}
+	o->pickupLast[channel]=v;
+	return(1);
+}
+
+// Send a source value to all destinations of its map
+// Unmapped sources (no destination) are handled by caller
+void midiSendMap(struct MidiOut *out, const unsigned char channel, struct MidiMap *map, const unsigned int val, const unsigned int max){
+	for(int d=0; d<map->destCount; d++){
+		if(filterInput(&map->dest[d], channel, val, max) && pickupInput(&map->dest[d], channel, val, max)){
+			midiSendDest(out, channel, &map->dest[d], val, max);
+		}
+	}
+}
+
+long long nowUs(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return((long long)ts.tv_sec*1000000+ts.tv_nsec/1000);
+}
+
+void midiSendHiRes(struct MidiOut *out, const unsigned char channel, struct MidiMap *map){
+	struct MapState *st=mapState(map);
+	unsigned int val=(st->msb[channel]<<7)+st->lsb[channel];
+	midiSendMap(out, channel, map, val, mapToMax[CC14]);
+}
+
+// Assemble 14-bit cc pairs, map is the one held by the MSB
+// MSB resets LSB to 0, as per MIDI spec. Once a controller has shown
+// it sends LSB, the MSB is held back until the LSB arrives
+// (or the timeout expires), so that a single message is sent.
+// Controllers that never send LSB get their MSB mapped right away.
+// Independent halves (coarse and fine knobs) are combined
+// and sent whenever either of them changes.
+void hiResInput(struct MidiOut *out, const unsigned char channel, struct MidiMap *map, const enum HiResHalf half, const unsigned char val){
+	struct MapState *st=mapState(map);
+	if(half==HIRES_LSB){
+		if(verbose>1) printf("l");
+		st->lsbSeen[channel]=1;
+		st->lsb[channel]=val;
+		if(st->lsbDeadline[channel]){
+			st->lsbDeadline[channel]=0;
+			port->hiResPending--;
+		}
+	}else{
+		if(verbose>1) printf("m");
+		st->msb[channel]=val;
+		if(map->independent){
+			midiSendHiRes(out, channel, map);
+			return;
+		}
+		st->lsb[channel]=0;
+		if(st->lsbSeen[channel] && map->lsbTimeout>0){
+			if(!st->lsbDeadline[channel]) port->hiResPending++;
+			st->lsbDeadline[channel]=nowUs()+1000LL*map->lsbTimeout;
+			return;
+		}
+	}
+	midiSendHiRes(out, channel, map);
+}
+
+// Relative encoder, move the channel position by the decoded number of detents
+void relativeInput(struct MidiOut *out, const unsigned char channel, struct MidiMap *map, const unsigned char val){
+	struct MapState *st=mapState(map);
+	int delta, pos;
+	switch(map->relative){
+		case REL_SIGN:
+			delta=(val&0x40)?-(val&0x3F):val;
+			break;
+		case REL_OFFSET:
+			delta=val-64;
+			break;
+		default:
+			delta=(val<64)?val:val-128;
+	}
+	if(verbose>1) printf("e%d", delta);
+	pos=(st->msb[channel]<<7)+st->lsb[channel];
+	if(delta>0){
+		pos+=map->relStep[delta];
+		if(pos>16383) pos=16383;
+	}else{
+		pos-=map->relStep[-delta];
+		if(pos<0) pos=0;
+	}
+	if(pos==(st->msb[channel]<<7)+st->lsb[channel]) return; // Already at range end
+	st->msb[channel]=pos>>7;
+	st->lsb[channel]=pos&0x7F;
+	midiSendHiRes(out, channel, map);
+}
+
+// 32-bit value from MIDI 2.0 input, for a mapped source
+// Destinations get it as a source value with 16 fraction bits,
+// filters work on whole source steps.
+// 14-bit source state is set to the value reduced to 14 bits.
+void wideInput(struct MidiOut *out, const unsigned char channel, struct MidiMap *map, const uint32_t val){
+	struct MidiDest *dest;
+	unsigned int srcVal;
+	if(verbose>1) printf("u");
+	if(map->hiRes!=HIRES_NONE){
+		struct MapState *st=mapState(map);
+		st->msb[channel]=val>>25;
+		st->lsb[channel]=(val>>18)&0x7F;
+		if(st->lsbDeadline[channel]){
+			st->lsbDeadline[channel]=0;
+			port->hiResPending--;
+		}
+	}
+	for(int d=0; d<map->destCount; d++){
+		dest=&map->dest[d];
+		srcVal=wideSource(val, dest->srcMax);
+		if(filterInput(dest, channel, srcVal>>16, dest->srcMax) && pickupInput(dest, channel, srcVal, dest->srcMax<<16)){
+			midiSendDest(out, channel, dest, srcVal, dest->srcMax<<16);
+		}
+	}
+}
+
+// Poly aftertouch input, val 0 for a released note
+// PAT destinations get the pressure of each note, thinned per note.
+// Other destinations get the pressure collapsed over held notes,
+// maximum or average, and only when it changes: one stream per channel.
+void polyInput(struct MidiOut *out, const unsigned char channel, const unsigned char note, const unsigned char val, const int noteOff){
+	struct MidiMap *map=&port->bank->patMap;
+	struct MidiDest *dest;
+	unsigned char old=port->polyIn[channel][note];
+	int v;
+	if(old){
+		port->polyCount[channel]--;
+		port->polySum[channel]-=old;
+	}
+	if(val){
+		port->polyCount[channel]++;
+		port->polySum[channel]+=val;
+	}
+	port->polyIn[channel][note]=val;
+	if(val>=port->polyMax[channel]){
+		port->polyMax[channel]=val;
+	}else if(old==port->polyMax[channel]){
+		port->polyMax[channel]=0;
+		for(int n=0; n<128; n++){
+			if(port->polyIn[channel][n]>port->polyMax[channel]) port->polyMax[channel]=port->polyIn[channel][n];
+		}
+	}
+	for(int d=0; d<map->destCount; d++){
+		dest=&map->dest[d];
+		if(dest->type==PAT){
+			if(noteOff){
+				port->polyOut[d][channel][note]=0;
+				continue;
+			}
+			// Extreme values always go through
+			if(val!=0 && val!=127 && abs(val-port->polyOut[d][channel][note])<=dest->options.thin) continue;
+			port->polyOut[d][channel][note]=val;
+			midiSendPolyAt(out, channel, note, dest, val);
+		}else{
+			if(dest->options.collapse==COLLAPSE_AVG){
+				v=port->polyCount[channel]?(port->polySum[channel]+port->polyCount[channel]/2)/port->polyCount[channel]:0;
+			}else{
+				v=port->polyMax[channel];
+			}
+			if(v==port->polyCollapsed[d][channel]) continue;
+			if(!filterInput(dest, channel, v, mapToMax[PAT]) || !pickupInput(dest, channel, v, mapToMax[PAT])) continue;
+			port->polyCollapsed[d][channel]=v;
+			midiSendDest(out, channel, dest, v, mapToMax[PAT]);
+		}
+	}
+}
+
+// Send MPE member pitch bend (type 0) or pressure (type 1) now
+void mpeSend(struct MidiOut *out, const unsigned char channel, const int type, const int val){
+	struct MidiMap *map=type?&port->bank->mpeAtMap:&port->bank->mpePbMap;
+	unsigned char outBuffer[3];
+	int k=0;
+	if(map->destCount){
+		midiSendMap(out, channel, map, val, mapToMax[type?AT:PB]);
+		return;
+	}
+	// No member map, pass through
+	outBuffer[k++]=(type?0xD0:0xE0)+channel;
+	if(type){
+		outBuffer[k++]=val;
+	}else{
+		outBuffer[k++]=val&0x7F;
+		outBuffer[k++]=val>>7;
+	}
+	passMessage(out, outBuffer, k);
+}
+
+// Take one message from the rate budget
+// Returns 1 if a message can be sent now
+int mpeTake(){
+	long long now=nowUs();
+	double burst=(port->mpe.rate<100)?1:port->mpe.rate/100.0; // 10 ms worth of messages
+	port->mpeTokens+=(now-port->mpeRefill)*port->mpe.rate/1e6;
+	if(port->mpeTokens>burst) port->mpeTokens=burst;
+	port->mpeRefill=now;
+	if(port->mpeTokens<1) return(0);
+	port->mpeTokens--;
+	return(1);
+}
+
+// MPE member pitch bend or pressure input
+// Over the rate budget, the value is held back and replaced by later ones
+void mpeInput(struct MidiOut *out, const unsigned char channel, const int type, const int val){
+	if(port->mpe.rate==0){
+		mpeSend(out, channel, type, val);
+		return;
+	}
+	if(port->mpeHeld[type][channel]>=0){
+		port->mpeHeld[type][channel]=val;
+		return;
+	}
+	if(mpeTake()){
+		mpeSend(out, channel, type, val);
+		return;
+	}
+	if(verbose>1) printf("h");
+	port->mpeHeld[type][channel]=val;
+	port->mpeHeldCount++;
+}
+
+// Send held back values of a channel, before another message on that channel
+// (a note on must not come before the pitch bend that preceded it)
+void mpeFlushChannel(struct MidiOut *out, const unsigned char channel){
+	for(int type=0; type<2; type++){
+		if(port->mpeHeld[type][channel]<0) continue;
+		mpeSend(out, channel, type, port->mpeHeld[type][channel]);
+		port->mpeHeld[type][channel]=-1;
+		port->mpeHeldCount--;
+		port->mpeTokens--; // Still counted, budget is caught up later
+	}
+}
+
+// Send held back values while budget allows, channels in turn
+void mpeRateFlush(struct MidiOut *out){
+	for(int n=0; n<32 && port->mpeHeldCount; n++){
+		int type=port->mpeNext>>4, channel=port->mpeNext&0x0F;
+		port->mpeNext=(port->mpeNext+1)&0x1F;
+		if(port->mpeHeld[type][channel]<0) continue;
+		if(!mpeTake()) return;
+		mpeSend(out, channel, type, port->mpeHeld[type][channel]);
+		port->mpeHeld[type][channel]=-1;
+		port->mpeHeldCount--;
+	}
+}
+
+// Send MSB alone when the LSB did not come in time
+void hiResTimeouts(struct MidiOut *out){
+	long long now=nowUs();
+	struct MapState *st;
+	for(int i=0; i<port->hiResCount && port->hiResPending; i++){
+		st=mapState(port->hiResMaps[i]);
+		for(int c=0; c<16; c++){
+			if(st->lsbDeadline[c] && st->lsbDeadline[c]<=now){
+				if(verbose>1) printf("t");
+				st->lsbDeadline[c]=0;
+				port->hiResPending--;
+				midiSendHiRes(out, c, port->hiResMaps[i]);
+			}
+		}
+	}
+}
+
+// Map of the NRPN/RPN selected on a channel, NULL if none
+struct MidiMap *selectedParmMap(const unsigned char channel){
+	struct ParmSelect *sel=&port->parmIn[channel];
+	unsigned parmNum=(sel->msb<<7)+sel->lsb;
+	if(PARM_KEY(sel->rpn, parmNum)==PARM_NULL) return(NULL);
+	return(findParmMap(port->bank, sel->rpn, parmNum));
+}
+
+// Input selected the null parameter: deselect in output too, so that
+// the receiver does not take later data entry for the previous parameter
+void parmNullInput(struct MidiOut *out, const unsigned char channel){
+	unsigned char outBuffer[5];
+	int k=0;
+	if(port->routeCount) out=routeOut(out, ROUTE_RPN, channel, 0x3FFF);
+	if(out->parmOut[channel]==PARM_NULL) return;
+	if(0xB0+channel!=out->runningStatus){
+		outBuffer[k++]=0xB0+channel;
+	}
+	outBuffer[k++]=101;
+	outBuffer[k++]=0x7F;
+	outBuffer[k++]=100;
+	outBuffer[k++]=0x7F;
+	out->parmOut[channel]=PARM_NULL;
+	midiSend(out, outBuffer, k);
+}
+
+// Decode incoming NRPN/RPN controllers
+// Parameter selection is held back until data arrives, except the null
+// parameter which is passed on at once.
+// Data for mapped parameters goes through the map like a 14-bit cc pair,
+// data for other parameters is passed through after selecting
+// the parameter in the output stream if needed.
+void parmInput(struct MidiOut *out, const unsigned char channel, const unsigned char ccNum, const unsigned char val){
+	struct ParmSelect *sel=&port->parmIn[channel];
+	struct MidiMap *map;
+	struct MapState *st;
+	unsigned parmNum;
+	int key, parmVal;
+	unsigned char outBuffer[7];
+	int k=0;
+	switch(ccNum){
+		case 99: sel->rpn=0; sel->msb=val; return;
+		case 98: sel->rpn=0; sel->lsb=val; return;
+		case 101:
+		case 100:
+			sel->rpn=1;
+			if(ccNum==101) sel->msb=val;
+			else sel->lsb=val;
+			if(PARM_KEY(1, (sel->msb<<7)+sel->lsb)==PARM_NULL) parmNullInput(out, channel);
+			return;
+	}
+	parmNum=(sel->msb<<7)+sel->lsb;
+	key=PARM_KEY(sel->rpn, parmNum);
+	if(key==PARM_NULL) return; // No parameter selected, data is meaningless
+	map=findParmMap(port->bank, sel->rpn, parmNum);
+	if(map && map->destCount){
+		if(verbose>1) printf(sel->rpn?"r":"n");
+		switch(ccNum){
+			case 6:
+				hiResInput(out, channel, map, HIRES_MSB, val);
+				break;
+			case 38:
+				hiResInput(out, channel, map, HIRES_LSB, val);
+				break;
+			case 96: // Increment
+			case 97: // Decrement
+				st=mapState(map);
+				parmVal=(st->msb[channel]<<7)+st->lsb[channel]+((ccNum==96)?1:-1);
+				if(parmVal<0 || parmVal>16383) return;
+				st->msb[channel]=parmVal>>7;
+				st->lsb[channel]=parmVal&0x7F;
+				midiSendHiRes(out, channel, map);
+				break;
+		}
+		return;
+	}
+	// Unmapped parameter, pass data through
+	if(port->routeCount) out=routeOut(out, sel->rpn?ROUTE_RPN:ROUTE_NRPN, channel, parmNum);
+	if(0xB0+channel!=out->runningStatus){
+		outBuffer[k++]=0xB0+channel;
+	}
+	if(out->parmOut[channel]!=key){
+		outBuffer[k++]=sel->rpn?101:99;
+		outBuffer[k++]=sel->msb;
+		outBuffer[k++]=sel->rpn?100:98;
+		outBuffer[k++]=sel->lsb;
+		out->parmOut[channel]=key;
+	}
+	outBuffer[k++]=ccNum;
+	outBuffer[k++]=val;
+	midiSend(out, outBuffer, k);
+	if(port->dataInc) parmPassed(channel, OUT_KEY(sel->rpn?RPN:NRPN, parmNum));
+}
+
+// Parse a [BankSelect] line: "PC [channel]", "CC number [channel]" or "SYSEX"
+// Channel is 1 to 16, any channel if omitted
+// Returns 0 on success, -1 on error
+int readBankSelect(char *start){
+	char *tail;
+	unsigned long n;
+	int *channel=NULL;
+	if (strncmp(start, "PC", 2)==0){
+		port->bankSelect.pc=1;
+		channel=&port->bankSelect.pcChannel;
+		start+=2;
+	}else if (strncmp(start, "CC", 2)==0){
+		n=strtoul(start+2, &tail, 0);
+		if (tail==start+2 || n>=map_size) return(-1);
+		port->bankSelect.cc=n;
+		channel=&port->bankSelect.ccChannel;
+		start=tail;
+	}else if (strncmp(start, "SYSEX", 5)==0){
+		port->bankSelect.sysex=1;
+		start+=5;
+	}else return(-1);
+	while(*start==' ' || *start=='\t') start++;
+	if (*start==',') start++;
+	while(*start==' ' || *start=='\t') start++;
+	if (channel){
+		n=strtoul(start, &tail, 0);
+		if (tail!=start){
+			if (n<1 || n>16) return(-1);
+			*channel=n-1;
+			start=tail;
+		}
+		if(verbose){
+			printf("Bank select by %s, ", (channel==&port->bankSelect.pcChannel)?"program change":"cc");
+			if(*channel<0) printf("any channel\n");
+			else printf("channel %d\n", *channel+1);
+		}
+	}else{
+		if(verbose) printf("Bank select by sysex\n");
+	}
+	while(*start==' ' || *start=='\t') start++;
+	if (*start && *start != '#' && *start != ';' && *start != '\n') return(-1);
+	return(0);
+}
+
+// Parse an [MPE] line: "LOWER members", "UPPER members" or "RATE messages per second"
+// Returns 0 on success, -1 on error
+int readMpe(char *start){
+	struct MpeConfig config=port->mpe;
+	unsigned long n;
+	char *tail;
+	int *field;
+	if (strncmp(start, "LOWER", 5)==0) field=&config.lower;
+	else if (strncmp(start, "UPPER", 5)==0) field=&config.upper;
+	else if (strncmp(start, "RATE", 4)==0) field=&config.rate;
+	else return(-1);
+	start+=(field==&config.rate)?4:5;
+	n=strtoul(start, &tail, 0);
+	if (tail==start || n>1000000) return(-1);
+	*field=n;
+	start=tail;
+	while(*start==' ' || *start=='\t') start++;
+	if (*start && *start != '#' && *start != ';' && *start != '\n') return(-1);
+	if (setMpeZones(&config)) return(-1);
+	if(verbose) printf("MPE lower zone %d members, upper zone %d members, rate %d/s\n", port->mpe.lower, port->mpe.upper, port->mpe.rate);
+	return(0);
+}
+
+// Parse "*", "n" or "n-m" of a [Route] line, advancing *start past it
+// Any is returned as -1, -1
+// Returns 0 on success, -1 if missing or out of min..max
+int readRange(char **start, int *from, int *to, const int min, const int max){
+	char *tail;
+	long n;
+	if (**start=='*'){
+		(*start)++;
+		*from=*to=-1;
+		return(0);
+	}
+	n=strtol(*start, &tail, 0);
+	if (tail==*start || n<min || n>max) return(-1);
+	*from=*to=n;
+	if (*tail=='-'){
+		*start=tail+1;
+		n=strtol(*start, &tail, 0);
+		if (tail==*start || n<*from || n>max) return(-1);
+		*to=n;
+	}
+	*start=tail;
+	return(0);
+}
+
+// Parse a [Route] line: "type channel [number] port"
+// Type is * or one of routeNames, channel is * or 1 to 16 or a range like 2-9,
+// number is a note, controller, program or parameter number or range.
+// Returns 0 on success, -1 on error
+int readRoute(char *start){
+	struct Route *r;
+	enum RouteType type;
+	char *tail;
+	size_t len;
+	if (port->routeCount==max_routes) return(-1);
+	r=&port->routes[port->routeCount];
+	for(type=ROUTE_SYS; type>ROUTE_ANY; type--){
+		len=strlen(routeNames[type]);
+		if (strncmp(start, routeNames[type], len)==0 && (start[len]==' ' || start[len]=='\t')) break;
+	}
+	if (type==ROUTE_ANY && *start!='*') return(-1);
+	r->type=type;
+	start+=(type==ROUTE_ANY)?1:strlen(routeNames[type]);
+	while(*start==' ' || *start=='\t') start++;
+	if (readRange(&start, &r->channelFrom, &r->channelTo, 1, 16)) return(-1);
+	if (r->channelFrom>=0){
+		r->channelFrom--;
+		r->channelTo--;
+	}
+	while(*start==' ' || *start=='\t') start++;
+	r->numFrom=r->numTo=-1;
+	if (isdigit(*start) && readRange(&start, &r->numFrom, &r->numTo, 0, 16383)) return(-1);
+	while(*start==' ' || *start=='\t') start++;
+	tail=start;
+	while(*tail && *tail!=' ' && *tail!='\t' && *tail!='\n' && *tail!='#' && *tail!=';') tail++;
+	if (tail==start || tail-start>=sizeof(r->to)) return(-1);
+	memcpy(r->to, start, tail-start);
+	r->to[tail-start]=0;
+	start=tail;
+	while(*start==' ' || *start=='\t') start++;
+	if (*start && *start != '#' && *start != ';' && *start != '\n') return(-1);
+	port->routeCount++;
+	if(verbose){
+		printf("Route %s", routeNames[r->type]);
+		if(r->channelFrom<0) printf(" any channel");
+		else printf(" channel %d-%d", r->channelFrom+1, r->channelTo+1);
+		if(r->numFrom>=0) printf(" number %d-%d", r->numFrom, r->numTo);
+		printf(" to port %s\n", r->to);
+	}
+	return(0);
+}
+
+// Set a buffer preset by name
+// Returns 0 on success, -1 if unknown
+int setBufferPreset(const char *name, const size_t len){
+	for(int n=0; n<sizeof(bufferPresets)/sizeof(bufferPresets[0]); n++){
+		if (strlen(bufferPresetNames[n])==len && strncmp(name, bufferPresetNames[n], len)==0){
+			int noActiveSensing=port->buffer.noActiveSensing; // Not a matter of presets, kept
+			port->buffer=bufferPresets[n];
+			port->buffer.noActiveSensing=noActiveSensing;
+			return(0);
+		}
+	}
+	return(-1);
+}
+
+// Check buffer settings of the current port
+// Returns 0 if valid, -1 otherwise
+int checkBuffer(){
+	struct BufferConfig *b=&port->buffer;
+	if (b->readSize<32 || b->readSize>buf_size) return(-1);
+	if (b->bufferSize && (b->bufferSize<32 || b->bufferSize>1048576)) return(-1);
+	if (b->availMin && b->bufferSize && b->availMin>b->bufferSize) return(-1);
+	if(verbose) printf("Read %d bytes, ALSA buffer %lu, avail min %lu%s\n", b->readSize, (unsigned long)b->bufferSize, (unsigned long)b->availMin, b->noActiveSensing?", no active sensing":"");
+	return(0);
+}
+
+// Parse a [Buffer] line: "PRESET name", "READ bytes", "SIZE bytes", "AVAIL bytes"
+// or "NO_ACTIVE_SENSING"
+// Returns 0 on success, -1 on error
+int readBuffer(char *start){
+	unsigned long n;
+	char *tail;
+	size_t *field=NULL;
+	if (strncmp(start, "PRESET", 6)==0){
+		start+=6;
+		while(*start==' ' || *start=='\t') start++;
+		tail=start;
+		while(isalpha(*tail)) tail++;
+		if (setBufferPreset(start, tail-start)) return(-1);
+		start=tail;
+	}else if (strncmp(start, "NO_ACTIVE_SENSING", 17)==0){
+		port->buffer.noActiveSensing=1;
+		start+=17;
+	}else{
+		if (strncmp(start, "READ", 4)==0) start+=4;
+		else if (strncmp(start, "SIZE", 4)==0) field=&port->buffer.bufferSize;
+		else if (strncmp(start, "AVAIL", 5)==0) field=&port->buffer.availMin;
+		else return(-1);
+		if (field) start+=(field==&port->buffer.availMin)?5:4;
+		n=strtoul(start, &tail, 0);
+		if (tail==start || n>1048576) return(-1);
+		if (field) *field=n;
+		else port->buffer.readSize=n;
+		start=tail;
+	}
+	while(*start==' ' || *start=='\t') start++;
+	if (*start && *start != '#' && *start != ';' && *start != '\n') return(-1);
+	return(checkBuffer());
+}
+
+// Parse -b option: preset name, or "read,size,avail" with 0 for driver default
+// Returns 0 on success, -1 on error
+int readBufferOption(const char *spec){
+	unsigned long n[3]={read_size, 0, 0};
+	char *tail;
+	if (isalpha(*spec)){
+		if (setBufferPreset(spec, strlen(spec))) return(-1);
+		return(checkBuffer());
+	}
+	for(int i=0; i<3; i++){
+		n[i]=strtoul(spec, &tail, 0);
+		if (tail==spec) return(-1);
+		spec=tail;
+		if (*spec==0) break;
+		if (*spec!=',' || i==2) return(-1);
+		spec++;
+	}
+	port->buffer.readSize=n[0]?n[0]:read_size;
+	port->buffer.bufferSize=n[1];
+	port->buffer.availMin=n[2];
+	return(checkBuffer());
+}
+
+void readIniFile(const char *filename){
 	FILE *fp;
 	size_t len = 0;
 	ssize_t read;
 	enum MapType currentDest = NONE, currentSrc = NONE;
-	unsigned long ccFrom, parmTo;
+	unsigned long ccFrom, lsbFrom=0, parmTo;
 	char *start, *tail, *line = NULL;
-	const char *sectionNames[]={"None\n", "[ToNrpn]\n", "[ToRpn]\n", "[ToCc]\n", "[ToPb]\n", "[ToAt]\n"};
+	const char *sectionNames[]={"None\n", "[ToNrpn]\n", "[ToRpn]\n", "[ToCc]\n", "[ToPb]\n", "[ToAt]\n", "[ToCc14]\n", "[ToPat]\n"};
 	long valFrom, valTo;
 	long valFrom0, valTo0;
+	struct MapOptions options;
+	int bankSelectSection=0;
+	int mpeSection=0;
+	int routeSection=0;
+	int bufferSection=0;
+	int mpeSrc; // Source is on MPE member channels
+	int relative; // Source is a relative encoder
 	int err=0;
 
-	printf("Reading file %s\n", filename);
-	fp = fopen(filename, "r");
-	if (fp == NULL){
-		errormessage("Error: cannot open file %s", filename);
-		exit(EXIT_FAILURE);
+	printf("Reading file %s\n", filename);
+	fp = fopen(filename, "r");
+	if (fp == NULL){
+		errormessage("Error: cannot open file %s", filename);
+		exit(EXIT_FAILURE);
+	}
+	currentDest = NONE;
+	editImage();
+	editBank = port->banks[0]; // Maps go to default bank until a [Bank name] section
+	while ((read = getline(&line, &len, fp)) != -1) {
+		if (len>0){ // Just skip empty lines (should not happen, always at least \n)
+			start=line;
+			while(*start==' ' || *start=='\t') start++;
+			if (start[0]!='#' && start[0]!=';' && start[0]!='\n'){ // Skip comment and blank lines
+				if (start[0]=='['){
+					// section header									
+					currentDest = NONE;
+					bankSelectSection = 0;
+					mpeSection = 0;
+					routeSection = 0;
+					bufferSection = 0;
+					// todo: case insensitive, ignore trailing blanks (needs custom stricmp)
+					if (strncmp(start, "[Bank ", 6)==0){
+						// Following sections go to the named bank
+						tail=strchr(start, ']');
+						if (tail==NULL || tail==start+6){
+							errormessage("Error: invalid bank name %s", start);
+							exit(-1);
+						}
+						*tail=0;
+						editBank=getBank(start+6);
+					}else if (strcmp(start, "[BankSelect]\n")==0){ bankSelectSection = 1;
+					}else if (strcmp(start, "[MPE]\n")==0){ mpeSection = 1;
+					}else if (strcmp(start, "[Route]\n")==0){ routeSection = 1;
+					}else if (strcmp(start, "[Buffer]\n")==0){ bufferSection = 1;
+					}else if (strcmp(start, sectionNames[NRPN])==0){ currentDest = NRPN;
+					}else if (strcmp(start, sectionNames[RPN])==0){ currentDest = RPN;
+					}else if (strcmp(start, sectionNames[CC])==0){ currentDest = CC;
+					}else if (strcmp(start, sectionNames[PB])==0){ currentDest = PB;
+					}else if (strcmp(start, sectionNames[AT])==0){ currentDest = AT;
+					}else if (strcmp(start, sectionNames[CC14])==0){ currentDest = CC14;
+					}else if (strcmp(start, sectionNames[PAT])==0){ currentDest = PAT;
+					}else printf("Warning: skipping section %s\n", start);
+				}else if (bufferSection){
+					if (readBuffer(start)){
+						errormessage("Error: invalid buffer setting \"%s\"", start);
+						exit(-1);
+					}
+				}else if (routeSection){
+					if (readRoute(start)){
+						errormessage("Error: invalid route \"%s\"", start);
+						exit(-1);
+					}
+				}else if (mpeSection){
+					if (readMpe(start)){
+						errormessage("Error: invalid MPE setting \"%s\"", start);
+						exit(-1);
+					}
+				}else if (bankSelectSection){
+					if (readBankSelect(start)){
+						errormessage("Error: invalid bank select \"%s\"", start);
+						exit(-1);
+					}
+				}else if (currentDest != NONE){
+					// map data: source, destination, [min, max,]
+					// Special sources: aftertouch AT, pitch bend PB,
+					// 14-bit controller pair CC14 followed by MSB cc number
+					// or by MSB/LSB cc numbers of two separate knobs,
+					// NRPN or RPN followed by parameter number
+					while(*start==' ' || *start=='\t') start++;
+					relative = 0;
+					mpeSrc = 0;
+					if (strncmp(start, "MPE", 3)==0){
+						// Member channel pitch bend or pressure
+						mpeSrc = 1;
+						start+=3;
+						while(*start==' ' || *start=='\t') start++;
+						if (strncmp(start, "PB", 2) && strncmp(start, "AT", 2)){
+							errormessage("Error: MPE source must be PB or AT \"%s\"", start);
+							exit(-1);
+						}
+					}
+					if (strncmp(start, "CC14", 4)==0 || strncmp(start, "NRPN", 4)==0 || strncmp(start, "RPN", 3)==0) {
+						currentSrc = (start[0]=='C')?CC14:(start[0]=='N')?NRPN:RPN;
+						start+=strlen(mapNames[currentSrc]);
+						ccFrom=strtoul(start, &tail, 0);
+						if (tail==start){
+							errormessage("Error: missing %s source number \"%s\"", mapNames[currentSrc], start);
+							exit(-1);
+						}
+						start=tail;
+						if (currentSrc==CC14){
+							if (*start=='/'){
+								start++;
+								lsbFrom=strtoul(start, &tail, 0);
+								if (tail==start){
+									errormessage("Error: missing LSB source number \"%s\"", start);
+									exit(-1);
+								}
+								start=tail;
+							}else if (ccFrom>mapNumMax[CC14]){
+								errormessage("Error: 14-bit CC %lu has no standard LSB, use MSB/LSB", ccFrom);
+								exit(-1);
+							}else{
+								lsbFrom=ccFrom+32;
+							}
+						}
+					}else if (strncmp(start, "REL", 3)==0) {
+						// Relative encoder cc
+						currentSrc = CC;
+						relative = 1;
+						start+=3;
+						ccFrom=strtoul(start, &tail, 0);
+						if (tail==start){
+							errormessage("Error: missing REL source number \"%s\"", start);
+							exit(-1);
+						}
+						start=tail;
+					}else if (strncmp(start, "PAT", 3)==0) {
+						currentSrc = PAT;
+						start+=3;
+					}else if (strncmp(start, "AT", 2)==0) {
+						currentSrc = AT;
+						start+=2;
+					}else if (strncmp(start, "PB", 2)==0) {
+						currentSrc = PB;
+						start+=2;
+					}else{
+						currentSrc = CC;
+						// Read the cc we are mapping from
+						ccFrom=strtoul(start, &tail, 0);
+						start=tail;
+					}
+					
+					if(currentDest==PAT && currentSrc!=PAT){
+						errormessage("Error: poly aftertouch can only be mapped from poly aftertouch");
+						exit(-1);
+					}
+					// Read the cc/rpn/nrpn we are mapping to,
+					// except for pitch bend and aftertouch (channel and poly)
+					if(currentDest!=PB && currentDest!=AT && currentDest!=PAT){
+						while(*start==' ' || *start=='\t') start++;
+						if (*start==',') start++; // optional comma separator
+						parmTo=strtoul(start, &tail, 0);
+						start=tail;
+					}else{
+						parmTo=0; // Will not be used anyway
+					}
+					
+					// Read optional (signed) range start and end values
+					// Ranges outside output values range result in value clipping
+					// todo readSigned(char **start, char **tail, long default)
+					valFrom=mapFromDefault[currentDest];
+					while(*start==' ' || *start=='\t') start++;
+					if (*start==',') start++; // accept trailing comma
+					valFrom0=strtol(start, &tail, 0);
+					if (tail!=start){
+						valFrom=valFrom0;
+						start=tail;
+					}
+
+					valTo=mapToDefault[currentDest];
+					while(*start==' ' || *start=='\t') start++;
+					if (*start==',') start++; // accept trailing comma
+					valTo0=strtol(start, &tail, 0);
+					if (tail!=start){
+						valTo=valTo0;
+						start=tail;
+					}
+
+					// Translate PB external representation to internal
+					if(currentDest==PB){
+						valFrom+=8192;
+						valTo+=8192;
+					}
+
+					// Read optional name=value settings
+					options=defaultOptions;
+					while(1){
+						while(*start==' ' || *start=='\t') start++;
+						if (*start==',') start++; // accept trailing comma
+						while(*start==' ' || *start=='\t') start++;
+						if (!isalpha((unsigned char)*start)) break;
+						if (readMapOption(&start, &options)){
+							errormessage("Error: invalid option \"%s\"", start);
+							exit(-1);
+						}
+					}
+
+					// Check line termination
+					if (*start && *start != '#' && *start != ';' && *start != '\n'){
+						errormessage("Error: unexpected data \"%s\"", start);
+						exit(-1);
+					}else{ // Line is properly terminated, set map accordingly
+						switch (currentSrc){
+						case AT:
+							if (mpeSrc) err=setMpeMap(AT, currentDest, parmTo, valFrom, valTo, &options);
+							else err=setAtMap(currentDest, parmTo, valFrom, valTo, &options);
+							break;
+						case PB:
+							if (mpeSrc) err=setMpeMap(PB, currentDest, parmTo, valFrom, valTo, &options);
+							else err=setPbMap(currentDest, parmTo, valFrom, valTo, &options);
+							break;
+						case PAT:
+							err=setPatMap(currentDest, parmTo, valFrom, valTo, &options);
+							break;
+						case CC:
+							if (relative) err=setRelMap(currentDest, ccFrom, parmTo, valFrom, valTo, &options);
+							else err=setCcMap(currentDest, ccFrom, parmTo, valFrom, valTo, &options);
+							break;
+						case CC14:
+							err=setCc14Map(currentDest, ccFrom, lsbFrom, parmTo, valFrom, valTo, &options);
+							break;
+						case NRPN:
+						case RPN:
+							err=setParmMap(currentSrc, ccFrom, currentDest, parmTo, valFrom, valTo, &options);
+							break;
+						default:
+							errormessage("Internal error: unexpected source %u\n", currentSrc);
+							exit(-1);
+						}
+						if (err){
+							errormessage("Error: invalid mapping, aborting");
+							exit(-1);
+						}
+					}
+				}
+			}
+		}
+	}
+
+	editBank = port->banks[0]; // Command line maps after -f go to default bank
+	fclose(fp);
+	if (line) free(line);
+}
+
+// FNV-1a, enough to detect a truncated or corrupted image
+uint32_t imageChecksum(const unsigned char *data, const size_t size){
+	uint32_t h=2166136261u;
+	for(size_t i=0; i<size; i++){
+		h^=data[i];
+		h*=16777619u;
+	}
+	return(h);
+}
+
+// Offsets of image parts, from the counts in header
+struct ImageLayout {
+	size_t banks;
+	size_t pages;
+	size_t parmMaps;
+	size_t hiRes;
+	size_t curves;
+	size_t size;
+};
+
+void imageLayout(struct ImageLayout *l, const struct MapImageHeader *header){
+	l->banks=image_align(sizeof(struct MapImageHeader));
+	l->pages=l->banks+(size_t)header->bankCount*sizeof(struct MapBank);
+	l->parmMaps=l->pages+(size_t)header->pageCount*sizeof(*port->parmPages);
+	l->hiRes=l->parmMaps+(size_t)header->parmCount*sizeof(struct MidiMap);
+	l->curves=l->hiRes+(size_t)header->hiResCount*sizeof(uint32_t);
+	l->size=l->curves+(size_t)header->curveSize*sizeof(*port->curveTables);
+}
+
+// Write all banks as a map image
+void writeMapImage(const char *filename){
+	struct MapImageHeader header={{0}};
+	struct ImageLayout l;
+	unsigned char *image;
+	uint32_t *offsets;
+	FILE *fp;
+
+	memcpy(header.magic, imageMagic, sizeof(header.magic));
+	header.version=image_version;
+	header.bankSize=sizeof(struct MapBank);
+	header.mapSize=sizeof(struct MidiMap);
+	header.bankCount=port->bankCount;
+	header.pageCount=port->pageCount;
+	header.parmCount=port->parmCount;
+	header.hiResCount=port->hiResCount;
+	header.curveSize=port->curveSize;
+	header.mapStateCount=port->mapStateCount;
+	header.destStateCount=port->destStateCount;
+	header.outStateCount=port->outStateCount;
+	header.bankSelect=port->bankSelect;
+	header.mpe=port->mpe;
+	imageLayout(&l, &header);
+	header.size=l.size;
+	image=calloc(1, l.size);
+	if(image==NULL){
+		errormessage("Error: out of memory");
+		exit(-1);
+	}
+
+	// Banks and pages are stored as they are, they refer to pages and maps by index
+	for(int b=0; b<port->bankCount; b++){
+		memcpy(image+l.banks+b*sizeof(struct MapBank), port->banks[b], sizeof(struct MapBank));
+	}
+	if(port->pageCount) memcpy(image+l.pages, port->parmPages, port->pageCount*sizeof(*port->parmPages));
+	for(int i=0; i<port->parmCount; i++){
+		memcpy(image+l.parmMaps+i*sizeof(struct MidiMap), port->parmMaps[i], sizeof(struct MidiMap));
+	}
+	offsets=(uint32_t *)(image+l.hiRes);
+	for(int i=0; i<port->hiResCount; i++){
+		for(int b=0; b<port->bankCount; b++){
+			if((char *)port->hiResMaps[i]>=(char *)port->banks[b] && (char *)port->hiResMaps[i]<(char *)(port->banks[b]+1)){
+				offsets[i]=l.banks+b*sizeof(struct MapBank)+((char *)port->hiResMaps[i]-(char *)port->banks[b]);
+			}
+		}
+		for(int p=0; p<port->parmCount; p++){
+			if(port->hiResMaps[i]==port->parmMaps[p]) offsets[i]=l.parmMaps+p*sizeof(struct MidiMap);
+		}
+		if(offsets[i]==0){
+			errormessage("Internal error: 14-bit map not found in any bank");
+			exit(-1);
+		}
+	}
+	if(port->curveSize) memcpy(image+l.curves, port->curveTables, port->curveSize*sizeof(*port->curveTables));
+	memcpy(image, &header, sizeof(header));
+	((struct MapImageHeader *)image)->checksum=imageChecksum(image+l.banks, l.size-l.banks);
+
+	fp=fopen(filename, "wb");
+	if(fp==NULL || fwrite(image, 1, l.size, fp)!=l.size || fclose(fp)){
+		errormessage("Error: cannot write %s", filename);
+		exit(-1);
+	}
+	printf("Wrote %s: %d banks, %u parameter maps, %zu bytes\n", filename, port->bankCount, header.parmCount, l.size);
+	free(image);
+}
+
+// A map of an image refers to pages, tables and state records that exist,
+// and every value used as an index, a length or a loop bound is in range
+int imageMapValid(const struct MidiMap *map, const struct MapImageHeader *header){
+	if(map->destCount<0 || map->destCount>max_dests || map->state<0 || map->state>header->mapStateCount) return(0);
+	if(map->hiRes>HIRES_LSB || map->pairNum>=map_size || map->relative>REL_OFFSET) return(0);
+	if((map->destCount || map->hiRes==HIRES_MSB || map->relative!=REL_NONE) && map->state==0) return(0);
+	for(int d=0; d<map->destCount; d++){
+		const struct MidiDest *dest=&map->dest[d];
+		if(dest->type<=NONE || dest->type>PAT || dest->num>mapNumMax[dest->type]) return(0);
+		if(dest->state<1 || dest->state>header->destStateCount || (dest->srcMax!=127 && dest->srcMax!=16383)) return(0);
+		if(dest->out<1 || dest->out>header->outStateCount) return(0);
+		if(dest->valFrom<-max_scale || dest->valFrom>max_scale || dest->valTo<-max_scale || dest->valTo>max_scale) return(0);
+		if(dest->curve>=0 && (size_t)dest->curve+dest->srcMax>=header->curveSize) return(0);
+		if(dest->tmplLen<1 || dest->tmplLen>max_template || dest->tmplHi>=dest->tmplLen || dest->tmplLo>=dest->tmplLen) return(0);
+		if(dest->options.dataEntry<DATA_BOTH || dest->options.dataEntry>DATA_INC) return(0);
+		if(dest->options.incMax<1 || dest->options.incMax>63) return(0);
+	}
+	return(1);
+}
+
+// Offset of a 14-bit source map in an image is the start of a bank map or NRPN/RPN map
+int imageMapOffset(const size_t offset, const struct ImageLayout *l){
+	size_t inBank;
+	if(offset>=l->parmMaps && offset<l->hiRes) return((offset-l->parmMaps)%sizeof(struct MidiMap)==0);
+	if(offset<l->banks || offset>=l->pages) return(0);
+	inBank=(offset-l->banks)%sizeof(struct MapBank);
+	if(inBank>=offsetof(struct MapBank, ccMaps) && inBank<offsetof(struct MapBank, ccMaps)+sizeof(((struct MapBank *)0)->ccMaps)){
+		return((inBank-offsetof(struct MapBank, ccMaps))%sizeof(struct MidiMap)==0);
+	}
+	return(inBank==offsetof(struct MapBank, atMap) || inBank==offsetof(struct MapBank, pbMap) || inBank==offsetof(struct MapBank, patMap)
+		|| inBank==offsetof(struct MapBank, mpePbMap) || inBank==offsetof(struct MapBank, mpeAtMap));
+}
+
+// Free maps and pools of the current port before another image replaces them
+// Banks, NRPN/RPN maps and pools in an image or its copy are released with it.
+int inImage(const void *p){
+	return((port->image && (unsigned char *)p>=port->image && (unsigned char *)p<port->image+port->imageSize)
+		|| (port->imageCopy && (unsigned char *)p>=port->imageCopy && (unsigned char *)p<port->imageCopy+port->imageSize));
+}
+
+void freeMaps(){
+	for(int b=0; b<port->bankCount; b++){
+		if(!inImage(port->banks[b])) free(port->banks[b]);
+	}
+	for(int i=0; i<port->parmCount; i++){
+		if(!inImage(port->parmMaps[i])) free(port->parmMaps[i]);
+	}
+	if(!port->poolsMapped){
+		free(port->curveTables);
+		free(port->parmPages);
+	}
+	port->bankCount=port->parmCount=port->pageCount=0;
+	port->curveTables=NULL;
+	port->parmPages=NULL;
+	port->curveSize=0;
+	if(port->image) munmap(port->image, port->imageSize);
+	free(port->imageCopy);
+	port->image=port->imageCopy=NULL;
+}
+
+// Use the banks of a checked image, in place
+// Only pointers held by the port are set, the image itself is never written.
+void useImage(unsigned char *image){
+	struct MapImageHeader *header=(struct MapImageHeader *)image;
+	struct ImageLayout l;
+	uint32_t *offsets;
+
+	imageLayout(&l, header);
+	for(int b=0; b<header->bankCount; b++){
+		port->banks[b]=(struct MapBank *)(image+l.banks+b*sizeof(struct MapBank));
+	}
+	port->bankCount=header->bankCount;
+	port->parmPages=(int (*)[128])(image+l.pages);
+	port->pageCount=header->pageCount;
+	port->parmMaps=realloc(port->parmMaps, header->parmCount*sizeof(*port->parmMaps));
+	offsets=(uint32_t *)(image+l.hiRes);
+	port->hiResMaps=realloc(port->hiResMaps, header->hiResCount*sizeof(*port->hiResMaps));
+	if((header->parmCount && port->parmMaps==NULL) || (header->hiResCount && port->hiResMaps==NULL)){
+		errormessage("Error: out of memory");
+		exit(-1);
+	}
+	for(int i=0; i<header->parmCount; i++){
+		port->parmMaps[i]=(struct MidiMap *)(image+l.parmMaps+i*sizeof(struct MidiMap));
+	}
+	port->parmCount=header->parmCount;
+	for(int i=0; i<header->hiResCount; i++){
+		port->hiResMaps[i]=(struct MidiMap *)(image+offsets[i]);
+	}
+	port->hiResCount=header->hiResCount;
+	port->curveTables=(unsigned short *)(image+l.curves);
+	port->curveSize=header->curveSize;
+	port->poolsMapped=1;
+	// Fresh run time state
+	free(port->mapStates);
+	free(port->destStates);
+	port->mapStates=NULL;
+	port->destStates=NULL;
+	port->mapStateCount=port->destStateCount=0;
+	addMapStates(header->mapStateCount);
+	addDestStates(header->destStateCount);
+	free(port->outStates);
+	port->outStates=calloc(header->outStateCount, sizeof(*port->outStates));
+	if(header->outStateCount && port->outStates==NULL){
+		errormessage("Error: out of memory");
+		exit(-1);
+	}
+	port->outStateCount=header->outStateCount;
+	for(int i=0; i<port->outStateCount; i++) resetOutState(&port->outStates[i]);
+	port->dataInc=0;
+	for(int b=0; b<port->bankCount; b++){
+		for(int m=0; m<map_size; m++) linkOutStates(&port->banks[b]->ccMaps[m]);
+		linkOutStates(&port->banks[b]->atMap);
+		linkOutStates(&port->banks[b]->pbMap);
+		linkOutStates(&port->banks[b]->patMap);
+		linkOutStates(&port->banks[b]->mpePbMap);
+		linkOutStates(&port->banks[b]->mpeAtMap);
+	}
+	for(int i=0; i<port->parmCount; i++) linkOutStates(port->parmMaps[i]);
+	port->hiResPending=0;
+	port->bankSelect=header->bankSelect;
+	setMpeZones(&header->mpe);
+	editBank=port->bank=port->banks[0];
+}
+
+// Map an image in place, replacing all banks
+// The mapping is read-only and shared: run time state is kept apart (MapState)
+void loadMapImage(const char *filename){
+	struct stat st;
+	struct MapImageHeader *header;
+	struct ImageLayout l;
+	struct MapBank *imageBank;
+	int *imagePage;
+	unsigned char *image;
+	uint32_t *offsets;
+	size_t maps;
+	int fd, valid;
+
+	fd=open(filename, O_RDONLY);
+	if(fd<0 || fstat(fd, &st)){
+		errormessage("Error: cannot open %s", filename);
+		exit(-1);
+	}
+	if(st.st_size<image_align(sizeof(struct MapImageHeader))){
+		errormessage("Error: %s is not a map image", filename);
+		exit(-1);
+	}
+	image=mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(image==MAP_FAILED){
+		errormessage("Error: cannot map %s", filename);
+		exit(-1);
+	}
+	header=(struct MapImageHeader *)image;
+	if(memcmp(header->magic, imageMagic, sizeof(header->magic))){
+		errormessage("Error: %s is not a map image", filename);
+		exit(-1);
+	}
+	if(header->version!=image_version || header->bankSize!=sizeof(struct MapBank) || header->mapSize!=sizeof(struct MidiMap)){
+		errormessage("Error: %s was compiled by another version, compile it again", filename);
+		exit(-1);
+	}
+	imageLayout(&l, header);
+	if(header->size!=st.st_size || l.size!=st.st_size || header->bankCount<1 || header->bankCount>max_banks
+		|| header->checksum!=imageChecksum(image+l.banks, l.size-l.banks)){
+		errormessage("Error: %s is corrupted", filename);
+		exit(-1);
+	}
+
+	// Check every index before the maps are used
+	// State records are allocated from the counts, there are no more than maps and destinations
+	imageBank=(struct MapBank *)(image+l.banks);
+	imagePage=(int *)(image+l.pages);
+	maps=(size_t)header->bankCount*(map_size+5)+header->parmCount;
+	valid=(header->mapStateCount<=maps && header->destStateCount<=maps*max_dests && header->outStateCount<=header->destStateCount
+		&& header->hiResCount<=maps && mpeValid(&header->mpe));
+	for(int b=0; b<header->bankCount && valid; b++){
+		for(int r=0; r<2; r++){
+			for(int m=0; m<128; m++){
+				if(imageBank[b].parmPages[r][m]<0 || imageBank[b].parmPages[r][m]>header->pageCount) valid=0;
+			}
+		}
+		for(int m=0; m<map_size; m++){
+			valid&=imageMapValid(&imageBank[b].ccMaps[m], header);
+			// LSB of a pair is sent through the map of its MSB
+			if(valid && imageBank[b].ccMaps[m].hiRes==HIRES_LSB && imageBank[b].ccMaps[imageBank[b].ccMaps[m].pairNum].hiRes!=HIRES_MSB) valid=0;
+		}
+		valid&=imageMapValid(&imageBank[b].atMap, header) && imageMapValid(&imageBank[b].pbMap, header)
+			&& imageMapValid(&imageBank[b].patMap, header) && imageMapValid(&imageBank[b].mpePbMap, header)
+			&& imageMapValid(&imageBank[b].mpeAtMap, header);
+	}
+	for(size_t n=0; n<(size_t)header->pageCount*128; n++){
+		if(imagePage[n]<0 || imagePage[n]>header->parmCount) valid=0;
+	}
+	for(int i=0; i<header->parmCount; i++){
+		valid&=imageMapValid((struct MidiMap *)(image+l.parmMaps+i*sizeof(struct MidiMap)), header);
+	}
+	offsets=(uint32_t *)(image+l.hiRes);
+	for(int i=0; i<header->hiResCount; i++){
+		if(!imageMapOffset(offsets[i], &l)) valid=0;
+		else valid&=imageMapValid((struct MidiMap *)(image+offsets[i]), header);
+	}
+	if(!valid){
+		errormessage("Error: %s is corrupted", filename);
+		exit(-1);
+	}
+	freeMaps();
+	port->image=image;
+	port->imageSize=st.st_size;
+	useImage(image);
+	if(verbose) printf("Loaded %s: %d banks\n", filename, port->bankCount);
+}
+
+// Maps are changed after loading an image (-f or maps after -i):
+// the image is read-only, work on a private copy instead
+void editImage(){
+	unsigned char *copy;
+	int edit, active;
+	if(port->image==NULL) return;
+	for(edit=0; edit<port->bankCount && port->banks[edit]!=editBank; edit++);
+	for(active=0; active<port->bankCount && port->banks[active]!=port->bank; active++);
+	copy=malloc(port->imageSize);
+	if(copy==NULL){
+		errormessage("Error: out of memory");
+		exit(-1);
+	}
+	memcpy(copy, port->image, port->imageSize);
+	freeMaps();
+	port->imageCopy=copy;
+	useImage(copy);
+	editBank=port->banks[edit];
+	port->bank=port->banks[active];
+}
+
+// Create a port and make it current, maps and options that follow go to it
+struct Port *newPort(const char *name){
+	struct Port *p;
+	if(portCount==max_ports){
+		errormessage("Error: too many ports (max %d)", max_ports);
+		exit(-1);
+	}
+	p=calloc(1, sizeof(struct Port));
+	if(p==NULL){
+		errormessage("Error: out of memory");
+		exit(-1);
+	}
+	strncpy(p->name, name, sizeof(p->name)-1);
+	p->bankSelect.cc=p->bankSelect.pcChannel=p->bankSelect.ccChannel=-1;
+	p->buffer.readSize=read_size;
+	ports[portCount++]=p;
+	port=p;
+	if(verbose) printf("Port %d: %s\n", portCount, p->name);
+	editBank=port->bank=getBank("default");
+	return(p);
+}
+
+// Set ALSA buffer parameters of one direction of the current port
+void setBufferParams(snd_rawmidi_t *handle, const int output){
+	snd_rawmidi_params_t *params;
+	int status;
+	if (handle==NULL) return;
+	if (!port->buffer.bufferSize && !(port->buffer.availMin && !output) && !(port->buffer.noActiveSensing && output)) return;
+	snd_rawmidi_params_alloca(&params);
+	status=snd_rawmidi_params_current(handle, params);
+	if (status>=0 && port->buffer.bufferSize) status=snd_rawmidi_params_set_buffer_size(handle, params, port->buffer.bufferSize);
+	if (status>=0 && port->buffer.availMin && !output) status=snd_rawmidi_params_set_avail_min(handle, params, port->buffer.availMin);
+	if (status>=0 && output) status=snd_rawmidi_params_set_no_active_sensing(handle, params, port->buffer.noActiveSensing);
+	if (status>=0) status=snd_rawmidi_params(handle, params);
+	if (status<0){
+		errormessage("Problem setting %s buffer of port %s: %s", output?"output":"input", port->name, snd_strerror(status));
+		exit(1);
+	}
+	if(verbose) printf("Port %s %s buffer %lu, avail min %lu\n", port->name, output?"output":"input",
+		(unsigned long)snd_rawmidi_params_get_buffer_size(params), (unsigned long)snd_rawmidi_params_get_avail_min(params));
+}
+
+// Reset stream state of the current port
+void resetPort(){
+	for(int c=0; c<16; c++){
+		port->parmIn[c].rpn=1;
+		port->parmIn[c].msb=port->parmIn[c].lsb=0x7F;
+		port->out.parmOut[c]=-1;
+		for(int d=0; d<max_dests; d++) port->polyCollapsed[d][c]=-1;
+		port->mpeHeld[0][c]=port->mpeHeld[1][c]=-1;
+	}
+	port->mpeTokens=port->mpe.rate; // Full bucket, capped on first use
+	port->mpeRefill=nowUs();
+	port->roomMin=(size_t)-1;
+}
+
+// Reset stream state of the current port and open its input and output
+void openPort(const int mode){
+	int openStatus=0;
+	resetPort();
+
+	if (port->umpDevice && strcmp(port->umpDevice, "-")==0){
+		errormessage("Error: UMP output to standard output (-U -) needs --filter");
+		exit(1);
+	}
+	// Virtual port for the side that is not a UMP endpoint
+	if (!port->umpInDevice || !port->umpDevice){
+		if ((openStatus = snd_rawmidi_open(port->umpInDevice?NULL:&port->midiin, port->umpDevice?NULL:&port->out.handle, "virtual", mode)) < 0) {
+			errormessage("Problem opening MIDI port %s: %s", port->name, snd_strerror(openStatus));
+			exit(1);
+		}
+	}
+	if (port->umpInDevice || port->umpDevice){
+#ifdef HAVE_UMP
+		if (port->umpInDevice && port->umpDevice && strcmp(port->umpInDevice, port->umpDevice)==0){
+			openStatus = snd_ump_open(&port->umpIn.handle, &port->out.ump, port->umpDevice, mode);
+		}else{
+			if (port->umpInDevice) openStatus = snd_ump_open(&port->umpIn.handle, NULL, port->umpInDevice, mode);
+			if (openStatus>=0 && port->umpDevice) openStatus = snd_ump_open(NULL, &port->out.ump, port->umpDevice, mode);
+		}
+		port->out.umpOut=(port->out.ump!=NULL);
+		if (openStatus < 0) {
+			errormessage("Problem opening UMP endpoint: %s", snd_strerror(openStatus));
+			exit(1);
+		}
+#else
+		errormessage("Error: UMP input and output need alsa-lib 1.2.10 or later");
+		exit(1);
+#endif
+	}
+#ifdef HAVE_UMP
+	if (port->umpIn.handle) setBufferParams(snd_ump_rawmidi(port->umpIn.handle), 0);
+	if (port->out.ump) setBufferParams(snd_ump_rawmidi(port->out.ump), 1);
+#endif
+	setBufferParams(port->midiin, 0);
+	setBufferParams(port->out.handle, 1);
+	// Hoped to retrieve the actual name, like "Client-133" but this just returns "virtual"
+	// printf ("Opened MIDI in: %s, out: %s \n", snd_rawmidi_name(midiin), snd_rawmidi_name(midiout));
+}
+
+void closePort(){
+	if (port->midiin) snd_rawmidi_close(port->midiin);
+#ifdef HAVE_UMP
+	if (port->umpIn.handle) snd_ump_close(port->umpIn.handle);
+	if (port->out.ump) snd_ump_close(port->out.ump);
+#endif
+	port->midiin = NULL; // snd_rawmidi_close() does not clear invalid pointer,
+	                     // so might be a good idea to erase it after closing.
+}
+
+// Length of the run of data bytes (00..7F) at the start of bytes, at most count
+int scanDataScalar(const unsigned char *bytes, const int count){
+	int i=0;
+	while(i<count && bytes[i]<0x80) i++;
+	return(i);
+}
+
+#ifdef HAVE_SIMD
+// The same, 64 bytes at a time: movemask gives the sign bits, set for status bytes
+__attribute__((target("sse2")))
+int scanDataSse2(const unsigned char *bytes, const int count){
+	int i=0;
+	for(; i+64<=count; i+=64){
+		uint64_t mask=(uint64_t)(uint16_t)_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)(bytes+i)))
+			| (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)(bytes+i+16)))<<16
+			| (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)(bytes+i+32)))<<32
+			| (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)(bytes+i+48)))<<48;
+		if(mask) return(i+__builtin_ctzll(mask));
+	}
+	return(i+scanDataScalar(bytes+i, count-i));
+}
+
+__attribute__((target("avx2")))
+int scanDataAvx2(const unsigned char *bytes, const int count){
+	int i=0;
+	for(; i+64<=count; i+=64){
+		uint64_t mask=(uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_loadu_si256((const __m256i *)(bytes+i)))
+			| (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_loadu_si256((const __m256i *)(bytes+i+32)))<<32;
+		if(mask) return(i+__builtin_ctzll(mask));
+	}
+	return(i+scanDataScalar(bytes+i, count-i));
+}
+#endif
+
+// Data byte scanners, the last available one is used
+struct Scanner {
+	const char *name;
+	int (*scan)(const unsigned char *bytes, const int count); // NULL decodes byte by byte
+	int available;
+} scanners[]={
+	{"bytes", NULL, 1}, // For --bench
+	{"scalar", scanDataScalar, 1},
+#ifdef HAVE_SIMD
+	{"sse2", scanDataSse2, 0},
+	{"avx2", scanDataAvx2, 0},
+#endif
+};
+#define scanner_count ((int)(sizeof(scanners)/sizeof(scanners[0])))
+int (*scanData)(const unsigned char *bytes, const int count)=scanDataScalar;
+
+// Check the CPU, returns the scanner used
+struct Scanner *selectScanner(){
+	struct Scanner *best=scanners;
+#ifdef HAVE_SIMD
+	__builtin_cpu_init();
+	scanners[2].available=__builtin_cpu_supports("sse2");
+	scanners[3].available=__builtin_cpu_supports("avx2");
+#endif
+	for(int n=0; n<scanner_count; n++){
+		if (scanners[n].available) best=&scanners[n];
+	}
+	scanData=best->scan;
+	return(best);
+}
+
+// Pipeline, first stage: decode a buffer of MIDI 1.0 bytes to events
+// Running status and a message split between reads are kept in the parser.
+// Data bytes without a status are dropped, as are those following a
+// system common message (it cancels running status).
+// Runs of data bytes (running status messages, sysex) are found with scanData
+// and decoded in bulk.
+// Returns the number of events, at most count+1
+int midiDecode(struct Parser *ps, const unsigned char *bytes, const int count, struct MidiEvent *events){
+	struct MidiEvent *ev=events;
+	unsigned char status=ps->runningStatusIn, b;
+	unsigned char *data=ps->data;
+	int need=midiDataLength(status), dataLen=ps->dataLen;
+	int sysexStart=0; // First byte of sysex chunk in this buffer
+	for(int i=0; i<count; i++){
+		b=bytes[i];
+		if(b<0x80){ // Data byte, 00..7F
+			if(ps->inSysex){ // Part of the chunk
+				if(scanData) i+=scanData(bytes+i, count-i)-1;
+				continue;
+			}
+			if(status==0) continue;
+			if(scanData && dataLen==0 && status<0xE0 && i+need<count && bytes[i+need]<0x80){
+				// Channel messages with running status: note, poly pressure, cc, program, channel pressure
+				// Only when another message follows, single messages are faster byte by byte
+				int run=scanData(bytes+i, count-i)/need;
+				for(int k=0; k<run; k++, i+=need){
+					ev->status=status;
+					ev->num=bytes[i];
+					ev->value=bytes[i+need-1];
+					ev->at=i+need-1;
+					ev++;
+				}
+				if(run){
+					i--;
+					continue;
+				}
+			}
+			data[dataLen++]=b;
+			if(dataLen<need) continue;
+			ev->status=status;
+			ev->num=data[0];
+			if((status&0xF0)==0xE0 || status==0xF2) ev->value=data[0]+(data[1]<<7);
+			else ev->value=data[need-1];
+			ev->at=i;
+			ev++;
+			dataLen=0;
+			if(status>=0xF0) status=0;
+			continue;
+		}
+		if(b>=0xF8){ // Real time, can occur anywhere, even in sysex
+			if(ps->inSysex && i>sysexStart){
+				ev->status=0xF0;
+				ev->num=0;
+				ev->at=sysexStart;
+				ev->len=i-sysexStart;
+				ev++;
+			}
+			sysexStart=i+1;
+			ev->status=b;
+			ev->at=i;
+			ev++;
+			continue;
+		}
+		// Status byte, 80..F7
+		if(ps->inSysex){
+			// End of sysex, F7 or any other status
+			ev->status=0xF0;
+			ev->num=1;
+			ev->at=sysexStart;
+			ev->len=i-sysexStart+(b==0xF7);
+			ev++;
+			ps->inSysex=0;
+			if(b==0xF7) continue;
+		}
+		status=b;
+		dataLen=0;
+		need=midiDataLength(status);
+		if(status==0xF0){
+			ps->inSysex=1;
+			sysexStart=i;
+			status=0;
+		}else if(need==0){ // Tune request, stray F7
+			ev->status=status;
+			ev->at=i;
+			ev++;
+			status=0;
+		}
+	}
+	if(ps->inSysex && count>sysexStart){
+		ev->status=0xF0;
+		ev->num=0;
+		ev->at=sysexStart;
+		ev->len=count-sysexStart;
+		ev++;
+	}
+	ps->runningStatusIn=status;
+	ps->dataLen=dataLen;
+	return(ev-events);
+}
+
+// MIDI 1.0 bytes of an event that is not a sysex chunk
+// Returns the length
+int eventBytes(const struct MidiEvent *ev, unsigned char *msg){
+	msg[0]=ev->status;
+	if((ev->status&0xF0)==0xE0 || ev->status==0xF2){
+		msg[1]=ev->value&0x7F;
+		msg[2]=ev->value>>7;
+	}else{
+		msg[1]=ev->num;
+		msg[2]=ev->value;
+	}
+	return(1+midiDataLength(ev->status));
+}
+
+// Send the start of a bank select sysex that was held back, it is not one
+void sysexRelease(struct MidiOut *sysOut){
+	struct Parser *ps=&port->parser;
+	midiSend(sysOut, bankSysex, (ps->sysexLen<3)?ps->sysexLen:3);
+	if (ps->sysexLen==4) midiSend(sysOut, &ps->sysexIndex, 1);
+	ps->sysexLen=0;
+}
+
+// Sysex input of the current port, a chunk at a time
+// Sysex is sent as it comes, except a possible bank select which is
+// held back until complete, and swallowed.
+void sysexInput(struct MidiOut *sysOut, const unsigned char *bytes, const int len, const int end){
+	struct Parser *ps=&port->parser;
+	int i=0;
+	if(len && bytes[0]==0xF0 && port->bankSelect.sysex){
+		ps->sysexLen=1;
+		i=1;
+	}
+	for(; ps->sysexLen && i<len; i++){
+		if (ps->sysexLen<3 && bytes[i]==bankSysex[ps->sysexLen]){
+			ps->sysexLen++;
+			continue;
+		}
+		if (ps->sysexLen==3 && bytes[i]<0x80){
+			ps->sysexIndex=bytes[i];
+			ps->sysexLen++;
+			continue;
+		}
+		if (ps->sysexLen==4 && bytes[i]==0xF7){
+			// Complete bank select sysex, swallowed
+			selectBank(ps->sysexIndex);
+			ps->sysexLen=0;
+			return;
+		}
+		// Not a bank select, pass held bytes and the rest of sysex through
+		sysexRelease(sysOut);
+		break;
+	}
+	if (ps->sysexLen){
+		if (!end) return; // Still possibly a bank select
+		sysexRelease(sysOut);
+	}
+	if (i<len) midiSend(sysOut, bytes+i, len-i);
+	if (end && (len==0 || bytes[len-1]!=0xF7) && sysOut->sysexPort==port){
+		// Sysex ended without F7, other ports can send again
+		midiSysexEnd(sysOut);
+	}
+}
+
+// Pipeline, second stage: map events of the current port and queue the output
+// Input bytes are needed for sysex chunks, and for UMP values (by byte index)
+void portEvents(const struct MidiEvent *events, const int n, const unsigned char *bytes){
+	struct MidiOut *out=&port->out;
+	struct UmpIn *umpIn=&port->umpIn;
+	struct MidiOut *sysOut=port->routeCount?routeOut(out, ROUTE_SYS, -1, -1):out;
+	struct MidiOut *ccOut;
+	const struct MidiEvent *ev;
+	unsigned char channel;
+	unsigned char msg[3]; // Passed through message
+	struct MidiMap *map;
+
+	for(ev=events; ev<events+n; ev++){
+		channel=ev->status&0x0F;
+		if (port->mpeHeldCount && ev->status<0xF0 && (ev->status&0xF0)!=0xD0 && (ev->status&0xF0)!=0xE0){
+			mpeFlushChannel(out, channel);
+		}
+		switch(ev->status&0xF0){
+		case 0xB0:
+			if(ev->num==port->bankSelect.cc && (port->bankSelect.ccChannel<0 || port->bankSelect.ccChannel==channel)){
+				selectBank(ev->value);
+				break;
+			}
+			if(port->bank->parmDecode && isParmCc(ev->num)){
+				if(umpIn->wideKind[ev->at]>=WIDE_PARM_MSB && (map=selectedParmMap(channel)) && map->destCount){
+					// Whole value is in the LSB
+					if(umpIn->wideKind[ev->at]==WIDE_PARM_LSB) wideInput(out, channel, map, umpIn->wide[ev->at]);
+				}else{
+					parmInput(out, channel, ev->num, ev->value);
+				}
+				break;
+			}
+			map=&port->bank->ccMaps[ev->num];
+			if(map->hiRes==HIRES_MSB && umpIn->wideKind[ev->at]==WIDE_VALUE){
+				wideInput(out, channel, map, umpIn->wide[ev->at]);
+			}else if(map->hiRes==HIRES_MSB){
+				hiResInput(out, channel, map, HIRES_MSB, ev->value);
+			}else if(map->hiRes==HIRES_LSB){
+				hiResInput(out, channel, &port->bank->ccMaps[map->pairNum], HIRES_LSB, ev->value);
+			}else if(map->relative!=REL_NONE){
+				relativeInput(out, channel, map, ev->value);
+			}else if(map->destCount==0){ // No mapping, pass message unchanged
+				ccOut=port->routeCount?routeOut(out, ROUTE_CC, channel, ev->num):out;
+				// Parameter selected in output is no longer known
+				if(ev->num>=98 && ev->num<=101) ccOut->parmOut[channel]=-1;
+				if(port->dataInc && isParmCc(ev->num) && ev->num<98){
+					// Data entry, increment or decrement of the parameter selected in output, if known
+					int key=ccOut->parmOut[channel];
+					parmPassed(channel, (key<0 || key==PARM_NULL)?-1:OUT_KEY((key>>14)?RPN:NRPN, key&0x3FFF));
+				}
+				midiSendMessage(ccOut, msg, eventBytes(ev, msg));
+			}else if(umpIn->wideKind[ev->at]==WIDE_VALUE){
+				wideInput(out, channel, map, umpIn->wide[ev->at]);
+			}else{
+				midiSendMap(out, channel, map, ev->value, mapToMax[CC]);
+			}
+			break;
+		case 0xD0:
+			if(port->mpeMember[channel]){
+				mpeInput(out, channel, 1, ev->value);
+			}else if(port->bank->atMap.destCount==0){
+				passMessage(out, msg, eventBytes(ev, msg));
+			}else if(umpIn->wideKind[ev->at]==WIDE_VALUE){
+				wideInput(out, channel, &port->bank->atMap, umpIn->wide[ev->at]);
+			}else{
+				midiSendMap(out, channel, &port->bank->atMap, ev->value, mapToMax[AT]);
+			}
+			break;
+		case 0xE0:
+			if(port->mpeMember[channel]){
+				mpeInput(out, channel, 0, ev->value);
+			}else if(port->bank->pbMap.destCount==0){
+				passMessage(out, msg, eventBytes(ev, msg));
+			}else if(umpIn->wideKind[ev->at]==WIDE_VALUE){
+				wideInput(out, channel, &port->bank->pbMap, umpIn->wide[ev->at]);
+			}else{
+				midiSendMap(out, channel, &port->bank->pbMap, ev->value, mapToMax[PB]);
+			}
+			break;
+		case 0xA0:
+			if(port->bank->patMap.destCount){
+				polyInput(out, channel, ev->num, ev->value, 0);
+			}else{
+				passMessage(out, msg, eventBytes(ev, msg));
+			}
+			break;
+		case 0xC0:
+			if (port->bankSelect.pc && (port->bankSelect.pcChannel<0 || port->bankSelect.pcChannel==channel)){
+				selectBank(ev->num);
+			}else{
+				passMessage(out, msg, eventBytes(ev, msg));
+			}
+			break;
+		case 0xF0:
+			if(ev->status==0xF0){
+				sysexInput(sysOut, bytes+ev->at, ev->len, ev->num);
+			}else{ // Real time, system common
+				passMessage(out, msg, eventBytes(ev, msg));
+			}
+			break;
+		default: // Note off, note on
+			passMessage(out, msg, eventBytes(ev, msg));
+			// Note off ends the pressure of a note, for collapsed poly aftertouch
+			if(port->polyCount[channel] && (ev->status<0x90 || ev->value==0) && port->polyIn[channel][ev->num]){
+				polyInput(out, channel, ev->num, 0, 1);
+			}
+		}
+		if(verbose==1){
+			printf(".");
+			fflush(stdout);
+		}
+	}
+	// Only sysex is sent before its end has been received
+	port->parser.midMessage=(port->parser.inSysex && port->parser.sysexLen==0);
+}
+
+// Parse a buffer of input of the current port: decode, map and encode
+// Output is queued, the caller flushes it once the buffer is done
+void portInput(const unsigned char *inBuffer, const int count){
+	struct MidiEvent events[buf_size+1];
+	int n=midiDecode(&port->parser, inBuffer, count, events);
+	portEvents(events, n, inBuffer);
+}
+
+// Forget the message being received by the current port, after input bytes were lost
+// Data bytes are then skipped until the next status byte, instead of being
+// taken as part of a message, or with a wrong running status.
+void parserResync(){
+	struct Parser *ps=&port->parser;
+	struct MidiOut *sysOut=port->routeCount?routeOut(&port->out, ROUTE_SYS, -1, -1):&port->out;
+	const unsigned char eox=0xF7;
+	if (ps->midMessage){
+		midiSend(sysOut, &eox, 1); // Close the sysex, it is incomplete anyway
+	}
+	ps->runningStatusIn=0;
+	ps->dataLen=0;
+	ps->inSysex=0;
+	ps->sysexLen=0;
+	ps->midMessage=0;
+	port->umpIn.count=0; // Packet boundary is lost too
+}
+
+// Check input and output of the current port for overruns
+// ALSA drops input bytes when its buffer is full, which only shows in the
+// xrun count of the status (reset by each status read). The buffer was full
+// of older bytes, so the gap is after the bytes still waiting in it: the
+// parser resyncs once they are read (portRead), or before the next read
+// when there are none. UMP input resyncs at once, packets are whole.
+// Checks are done at most every status_interval, unless forced by a read that
+// filled the buffer (input is backing up).
+void portStatus(const int force){
+	snd_rawmidi_status_t *status;
+	snd_rawmidi_t *in=port->midiin, *outHandle=port->out.handle;
+	size_t xruns, avail;
+	long long now=nowUs();
+	if (now-port->statusTime<status_interval && !force) return;
+	port->statusTime=now;
+	snd_rawmidi_status_alloca(&status);
+#ifdef HAVE_UMP
+	if (port->umpIn.handle) in=snd_ump_rawmidi(port->umpIn.handle);
+	if (port->out.ump) outHandle=snd_ump_rawmidi(port->out.ump);
+#endif
+	if (snd_rawmidi_status(in, status)==0){
+		xruns=snd_rawmidi_status_get_xruns(status);
+		avail=snd_rawmidi_status_get_avail(status);
+		if (avail>port->backlogMax) port->backlogMax=avail;
+		if (xruns){
+			port->overruns++;
+			port->bytesLost+=xruns;
+			errormessage("Warning: port %s input overrun, %lu bytes lost", port->name, (unsigned long)xruns);
+			if (avail && !port->umpIn.handle) port->resyncAfter=avail;
+			else parserResync();
+		}
+	}
+	if (snd_rawmidi_status(outHandle, status)==0){
+		port->xrunsOut+=snd_rawmidi_status_get_xruns(status);
+		avail=snd_rawmidi_status_get_avail(status);
+		if (avail<port->roomMin) port->roomMin=avail;
+	}
+}
+
+// Process bytes read from the current port
+// When an overrun left a gap in the bytes still to be read, the parser resyncs there.
+void portRead(const unsigned char *inBuffer, const int count){
+	int before=count;
+	if (port->resyncAfter && port->resyncAfter<=(size_t)count) before=port->resyncAfter;
+	portInput(inBuffer, before);
+	if (port->resyncAfter){
+		port->resyncAfter-=before;
+		if (port->resyncAfter==0){
+			parserResync();
+			portInput(inBuffer+before, count-before);
+		}
+	}
+}
+
+// Print statistics of the current port
+void portStats(){
+	printf("Port %s: %lu bytes in, %lu overruns (%lu bytes lost), %lu output xruns, input backlog max %lu",
+		port->name, port->bytesIn, port->overruns, port->bytesLost, port->xrunsOut, (unsigned long)port->backlogMax);
+	if (port->roomMin!=(size_t)-1) printf(", output room min %lu", (unsigned long)port->roomMin);
+	if (port->heldDropped) printf(", %lu bytes dropped behind a sysex", port->heldDropped);
+	printf("\n");
+}
+
+// Send values held back by the current port, unless its output is in the middle of a message
+// Returns 1 if values are still held back
+int portIdle(){
+	if (port->parser.midMessage) return(port->hiResPending || port->mpeHeldCount);
+	if (port->hiResPending) hiResTimeouts(&port->out);
+	if (port->mpeHeldCount) mpeRateFlush(&port->out);
+	return(port->hiResPending || port->mpeHeldCount);
+}
+
+// Find the output of each route, and give ports linked by routes the same
+// worker, so that each output is only written by one thread
+void resolveRoutes(){
+	int group[max_ports]; // Lowest index of linked ports
+	int groupCount=0;
+	int t, a, b;
+	struct Route *r;
+	for(int n=0; n<portCount; n++) group[n]=n;
+	for(int n=0; n<portCount; n++){
+		for(int i=0; i<ports[n]->routeCount; i++){
+			r=&ports[n]->routes[i];
+			for(t=0; t<portCount && strcmp(ports[t]->name, r->to); t++);
+			if (t==portCount){
+				errormessage("Error: port %s routes to unknown port %s", ports[n]->name, r->to);
+				exit(-1);
+			}
+			r->out=&ports[t]->out;
+			a=(group[n]<group[t])?group[n]:group[t];
+			b=(group[n]<group[t])?group[t]:group[n];
+			for(int m=0; m<portCount; m++){
+				if (group[m]==b) group[m]=a;
+			}
+		}
 	}
-	currentDest = NONE;
-	while ((read = getline(&line, &len, fp)) != -1) {
-		if (len>0){ // Just skip empty lines (should not happen, always at least \n)
-			start=line;
-			while(*start==' ' || *start=='\t') start++;
-			if (start[0]!='#' && start[0]!=';' && start[0]!='\n'){ // Skip comment and blank lines
-				if (start[0]=='['){
-					// section header									
-					currentDest = NONE;
-					// todo: case insensitive, ignore trailing blanks (needs custom stricmp)
-					if (strcmp(start, sectionNames[NRPN])==0){ currentDest = NRPN;
-					}else if (strcmp(start, sectionNames[RPN])==0){ currentDest = RPN;
-					}else if (strcmp(start, sectionNames[CC])==0){ currentDest = CC;
-					}else if (strcmp(start, sectionNames[PB])==0){ currentDest = PB;
-					}else if (strcmp(start, sectionNames[AT])==0){ currentDest = AT;
-					}else printf("Warning: skipping section %s\n", start);
-				}else if (currentDest != NONE){
-					// map data: source, destination, [min, max,]
-					// Special sources: aftertouch AT, pitch bend PB
-					while(*start==' ' || *start=='\t') start++;
-					if (strncmp(start, "AT", 2)==0) {
-						currentSrc = AT;
-						start+=2;
-					}else if (strncmp(start, "PB", 2)==0) {
-						currentSrc = PB;
-						start+=2;
-					}else{
-						currentSrc = CC;
-						// Read the cc we are mapping from
-						ccFrom=strtoul(start, &tail, 0);
-						start=tail;
-					}
-					
-					// Read the cc/rpn/nrpn we are mapping to,
-					// except for pitch bend and aftertouch
-					if(currentDest!=PB && currentDest!=AT){
-						while(*start==' ' || *start=='\t') start++;
-						if (*start==',') start++; // optional comma separator
-						parmTo=strtoul(start, &tail, 0);
-						start=tail;
-					}else{
-						parmTo=0; // Will not be used anyway
-					}
-					
-					// Read optional (signed) range start and end values
-					// Ranges outside output values range result in value clipping
-					// todo readSigned(char **start, char **tail, long default)
-					valFrom=mapFromDefault[currentDest];
-					while(*start==' ' || *start=='\t') start++;
-					if (*start==',') start++; // accept trailing comma
-					valFrom0=strtol(start, &tail, 0);
-					if (tail!=start){
-						valFrom=valFrom0;
-						start=tail;
-					}
+	for(int n=0; n<portCount; n++){
+		if (group[n]==n) groupCount++;
+	}
+	if (threadCount>groupCount) threadCount=groupCount;
+	groupCount=0;
+	for(int n=0; n<portCount; n++){
+		if (group[n]==n) ports[n]->worker=(groupCount++)%threadCount;
+		else ports[n]->worker=ports[group[n]]->worker;
+	}
+}
 
-					valTo=mapToDefault[currentDest];
-					while(*start==' ' || *start=='\t') start++;
-					if (*start==',') start++; // accept trailing comma
-					valTo0=strtol(start, &tail, 0);
-					if (tail!=start){
-						valTo=valTo0;
-						start=tail;
-					}
+// Write what ports of a worker have queued, one write per output
+void flushPorts(const int worker){
+	for(int n=0; n<portCount; n++){
+		if (ports[n]->worker==worker) midiFlush(&ports[n]->out);
+	}
+}
 
-					// Translate PB external representation to internal
-					if(currentDest==PB){
-						valFrom+=8192;
-						valTo+=8192;
-					}
+// Worker loop, serves the ports given to the worker by resolveRoutes
+// The thread sleeps until one of its ports has input. While values are
+// held back (14-bit LSB wait, MPE rate limit), it wakes up every ms.
+void *servePorts(void *arg){
+	const int worker=(intptr_t)arg;
+	int readStatus, ready, pending, nfds;
+	int epollFd=epoll_create1(0);
+	struct epoll_event events[max_ports+1];
+	struct epoll_event ev;
+	struct pollfd pfds[8];
+	unsigned char inBuffer[buf_size];
 
-					// Check line termination
-					while(*start==' ' || *start=='\t') start++;
-					if (*start==',') start++; // accept trailing comma
-					while(*start==' ' || *start=='\t') start++;
-					if (*start && *start != '#' && *start != ';' && *start != '\n'){
-						errormessage("Error: unexpected data \"%s\"", start);
-						exit(-1);
-					}else{ // Line is properly terminated, set map accordingly
-						switch (currentSrc){
-						case AT:
-							err=setAtMap(currentDest, parmTo, valFrom, valTo);
-							break;
-						case PB:
-							err=setPbMap(currentDest, parmTo, valFrom, valTo);
-							break;
-						case CC:
-							err=setCcMap(currentDest, ccFrom, parmTo, valFrom, valTo);
-							break;
-						default:
-							errormessage("Internal error: unexpected source %u\n", currentSrc);
-							exit(-1);
-						}
-						if (err){
-							errormessage("Error: invalid mapping, aborting");
-							exit(-1);
-						}
-					}
+	if (epollFd<0){
+		errormessage("Problem creating epoll instance: %s", strerror(errno));
+		exit(1);
+	}
+	ev.events=EPOLLIN;
+	ev.data.ptr=NULL; // Stop pipe
+	epoll_ctl(epollFd, EPOLL_CTL_ADD, stopPipe[0], &ev);
+	for(int n=0; n<portCount; n++){
+		if (ports[n]->worker!=worker) continue;
+		port=ports[n];
+#ifdef HAVE_UMP
+		if (port->umpIn.handle) nfds=snd_ump_poll_descriptors(port->umpIn.handle, pfds, 8);
+		else
+#endif
+		nfds=snd_rawmidi_poll_descriptors(port->midiin, pfds, 8);
+		for(int f=0; f<nfds; f++){
+			ev.events=EPOLLIN;
+			ev.data.ptr=port;
+			if (epoll_ctl(epollFd, EPOLL_CTL_ADD, pfds[f].fd, &ev)<0){
+				errormessage("Problem waiting for port %s: %s", port->name, strerror(errno));
+				exit(1);
+			}
+		}
+	}
+
+	while (keepRunning) {
+		pending=0;
+		for(int n=0; n<portCount; n++){
+			if (ports[n]->worker!=worker) continue;
+			port=ports[n];
+			pending|=portIdle();
+		}
+		flushPorts(worker);
+		ready=epoll_wait(epollFd, events, max_ports+1, pending?1:-1);
+		if (ready<0){
+			if (errno==EINTR) continue;
+			errormessage("Problem waiting for MIDI input: %s", strerror(errno));
+			break;
+		}
+		for(int e=0; e<ready && keepRunning; e++){
+			if (events[e].data.ptr==NULL) continue; // Stopping
+			port=events[e].data.ptr;
+			// Read until there is nothing left: a virtual port reads a whole batch of
+			// sequencer events into alsa-lib, and epoll does not see what is left there
+			while (keepRunning){
+				readStatus = port->umpIn.handle?umpRead(&port->umpIn, inBuffer, port->buffer.readSize):snd_rawmidi_read(port->midiin, inBuffer, port->buffer.readSize);
+				if (readStatus == -EAGAIN) break;
+				if (readStatus == -ENOSPC){ // Virtual port lost input, the gap is here
+					port->overruns++;
+					errormessage("Warning: port %s input overrun", port->name);
+					port->resyncAfter=0;
+					parserResync();
+					continue;
+				}
+				if (readStatus<0){
+					if (keepRunning) errormessage("Problem reading MIDI input on port %s: %s", port->name, snd_strerror(readStatus));
+					keepRunning=0;
+					write(stopPipe[1], "", 1); // Stop other workers too
+					break;
+				}
+				if(verbose>1){
+					if (portCount>1) printf("\n%s", port->name);
+					printf("\n[%u]", readStatus);
+					dump(inBuffer, readStatus);
+					fflush(stdout);
 				}
+				port->bytesIn+=readStatus;
+				portRead(inBuffer, readStatus);
+				flushPorts(worker); // Everything mapped from this input buffer in a single write per output
+				portStatus(readStatus==port->buffer.readSize);
 			}
 		}
 	}
+	close(epollFd);
+	return(NULL);
+}
 
-	fclose(fp);
-	if (line) free(line);
+// Filter mode: MIDI bytes from stdin go through the first port to fd (the original stdout), without ALSA
+// Output of other ports (routes) goes to fd too.
+// Ports with -U - write UMP packets instead, 32-bit words in host byte order.
+void filterStdin(const int fd){
+	unsigned char inBuffer[buf_size];
+	int readStatus;
+	for(int n=0; n<portCount; n++){
+		port=ports[n];
+		resetPort();
+		port->out.fd=fd;
+		if (port->umpDevice){
+			if (strcmp(port->umpDevice, "-")){
+				errormessage("Error: in filter mode, UMP output is standard output (-U -)");
+				exit(1);
+			}
+			port->out.umpOut=1;
+		}
+	}
+	port=ports[0];
+	while ((readStatus=read(0, inBuffer, port->buffer.readSize))>0){
+		port->bytesIn+=readStatus;
+		portInput(inBuffer, readStatus);
+		portIdle();
+		flushPorts(port->worker);
+	}
+	if (readStatus<0){
+		errormessage("Problem reading standard input: %s", strerror(errno));
+		exit(1);
+	}
+	// Held back values are still sent
+	while (portIdle()) usleep(1000);
+	flushPorts(port->worker);
+}
+
+// Generated traffic for --bench, at most size bytes
+// Returns the length
+int benchTraffic(unsigned char *buffer, const int size, const int flood){
+	int len=0;
+	if (flood){
+		// Controller flood: running status cc pairs, a new channel every 64
+		for(int i=0; len+3<=size; i++){
+			if (i%64==0) buffer[len++]=0xB0+((i/64)&0x0F);
+			buffer[len++]=1+(i&7);
+			buffer[len++]=i&0x7F;
+		}
+		return(len);
+	}
+	// Mixed traffic: controllers with running status, notes, pitch bend, pressure
+	for(int i=0; len+13<=size; i++){
+		buffer[len++]=0xB0;
+		buffer[len++]=7;
+		buffer[len++]=i&0x7F;
+		buffer[len++]=1;
+		buffer[len++]=(i*3)&0x7F;
+		buffer[len++]=0x90;
+		buffer[len++]=36+(i&0x1F);
+		buffer[len++]=(i&1)?0:100;
+		buffer[len++]=0xE0;
+		buffer[len++]=i&0x7F;
+		buffer[len++]=(i>>2)&0x7F;
+		buffer[len++]=0xD0;
+		buffer[len++]=(i*5)&0x7F;
+	}
+	return(len);
+}
+
+// Clock of the decoding benchmark, TSC cycles when available
+long long benchClock(){
+#ifdef HAVE_SIMD
+	return(__rdtsc());
+#else
+	return(nowUs()*1000);
+#endif
+}
+#ifdef HAVE_SIMD
+#define bench_unit "cycle"
+#else
+#define bench_unit "ns"
+#endif
+
+// Benchmark mode: time the pipeline on generated input, through the first port
+// Decoding alone is timed first with each scanner, then the whole pipeline
+// with the scanner selected for this CPU. Output is dropped.
+void benchPipeline(const int buffers, struct Scanner *selected){
+	unsigned char inBuffer[buf_size];
+	struct MidiEvent events[buf_size+1];
+	struct Parser ps;
+	int size, eventCount=0;
+	long long t0, t1;
+	for(int n=0; n<portCount; n++){
+		port=ports[n];
+		resetPort();
+		port->out.fd=-1;
+	}
+	port=ports[0];
+	for(int flood=0; flood<2; flood++){
+		size=benchTraffic(inBuffer, port->buffer.readSize, flood);
+		memset(&ps, 0, sizeof(ps));
+		printf("%s: %d buffers of %d bytes, %d events each\n", flood?"Controller flood":"Mixed traffic",
+			buffers, size, midiDecode(&ps, inBuffer, size, events));
+		for(int n=0; n<scanner_count; n++){
+			if (!scanners[n].available) continue;
+			scanData=scanners[n].scan;
+			memset(&ps, 0, sizeof(ps));
+			t0=benchClock();
+			for(int b=0; b<buffers; b++) eventCount=midiDecode(&ps, inBuffer, size, events);
+			t1=benchClock();
+			if (t1==t0) t1++;
+			printf("Decode %s: %.2f bytes per %s\n", scanners[n].name, (double)size*buffers/(t1-t0), bench_unit);
+		}
+		scanData=selected->scan;
+		t0=nowUs();
+		for(int b=0; b<buffers; b++){
+			portInput(inBuffer, size);
+			flushPorts(port->worker);
+		}
+		t1=nowUs();
+		if (t1==t0) t1++;
+		printf("Pipeline %s: %.1f MB/s, %.2f ns per byte, %.0f events per second\n", selected->name, (double)size*buffers/(t1-t0),
+			(t1-t0)*1000.0/((double)size*buffers), (double)eventCount*buffers*1e6/(t1-t0));
+	}
 }
 
 int main(int argc, char *argv[]) {
-	int openStatus=0, writeStatus=0, readStatus=0; // Status returned by open, write and read
-	unsigned char runningStatusIn=0; // Current MIDI Status from input stream
-	unsigned char runningStatusOut=0; // Current MIDI Status in output stream
-	unsigned char newStatusOut; // Future MIDI Status in output stream
-	// Output (running) status can be different from last input status
-	// This occurs when mapping cc to pitch, and when mapping from aftertouch
-	unsigned char ccNum, channel; // MIDI controller number and value
-	unsigned char atVal; // After-touch value (7 bits)
-	int pbVal; // Pitch bend value; unsigned offset by 8192, not signed, keep sign for clipping only
-	int pbLSB;
-	int parmVal; // RPN or NRPN value, unsigned, keep sign for clipping only
-	int ccVal; // Control change, keep sign for clipping only
 	// int mode = SND_RAWMIDI_SYNC; // don't use, see below
+	// blocking mode on "virtual" drops bytes ???
+	// Ports are non-blocking, and waited for with epoll
 	int mode = SND_RAWMIDI_NONBLOCK;
-	enum readStates {PASSTHRU, GOT_CC, PROCESS_CC_NONE, PROCESS_CC_PARM, PROCESS_CC_CC, PROCESS_CC_PB, PROCESS_CC_AT, GOT_AT, GOT_PB, PROCESS_PB} readState;
-	snd_rawmidi_t* midiin = NULL;
-	snd_rawmidi_t* midiout = NULL;
+	pthread_t threads[max_threads];
 
-	init_maps();
-	atMap.type=NONE;
-	
 	int i=1;
 	int need_map=0;
 	int currentType=NRPN;
 	unsigned long n1, n2;
 	char *tail;
+	char *compileFile=NULL;
+	int filter=-1;
+	int benchBuffers=0;
+	// In filter mode standard output carries MIDI, messages go to standard error
+	for(int n=1; n<argc; n++){
+		if (strcmp(argv[n], "--filter")==0 && filter<0){
+			filter=dup(1);
+			dup2(2, 1);
+		}
+	}
 	// Process command-line options
 	while (i<argc){
 		int cc, nrpn;
+		// Options before the first -P set up a port named default
+		if (port==NULL && (argv[i][0]!='-' || !argv[i][1] || strchr("vxhtP", argv[i][1])==NULL)) newPort("default");
 	    if (argv[i][0]=='-'){
 			if (need_map){
 				errormessage("Error: expecting map value, not %s", argv[i]);
@@ -587,6 +4068,71 @@ int main(int argc, char *argv[]) {
 					}
 					readIniFile(argv[i]);
 					break;
+				case 'U':
+				case 'u':
+				    i++;
+				    if (i>=argc){
+						errormessage("Error: missing UMP device name");
+						exit(-1);
+					}
+					if (argv[i-1][1]=='U') port->umpDevice=argv[i];
+					else port->umpInDevice=argv[i];
+					break;
+				case 'P':
+				    i++;
+				    if (i>=argc){
+						errormessage("Error: missing port name");
+						exit(-1);
+					}
+					newPort(argv[i]);
+					break;
+				case 'b':
+				    i++;
+				    if (i>=argc || readBufferOption(argv[i])){
+						errormessage("Error: buffer must be latency, throughput or read,size,avail (read 32 to %d)", buf_size);
+						exit(-1);
+					}
+					break;
+				case 'S':
+					port->buffer.noActiveSensing=1;
+					break;
+				case 't':
+				    i++;
+					if (i<argc) threadCount=strtoul(argv[i], &tail, 0);
+				    if (i>=argc || *tail || threadCount<1 || threadCount>max_threads){
+						errormessage("Error: thread count must be 1 to %d", max_threads);
+						exit(-1);
+					}
+					break;
+				case 'i':
+				    i++;
+				    if (i>=argc){
+						errormessage("Error: missing filename");
+						exit(-1);
+					}
+					loadMapImage(argv[i]);
+					break;
+				case '-':
+					if (strcmp(argv[i], "--compile")==0){
+						i++;
+						if (i>=argc){
+							errormessage("Error: missing filename");
+							exit(-1);
+						}
+						compileFile=argv[i];
+						break;
+					}
+					if (strcmp(argv[i], "--filter")==0) break;
+					if (strcmp(argv[i], "--bench")==0){
+						i++;
+						if (i<argc) benchBuffers=strtoul(argv[i], &tail, 0);
+						if (i>=argc || *tail || benchBuffers<1){
+							errormessage("Error: missing number of buffers");
+							exit(-1);
+						}
+						break;
+					}
+					// fall through
 				default:
 					errormessage("Error: Unknown option %s", argv[i]);
 					usage(argv[0]);
@@ -603,7 +4149,8 @@ int main(int argc, char *argv[]) {
 				int valFrom, valTo;
 				valFrom=mapFromDefault[currentType];
 				valTo=mapToDefault[currentType];
-				if (setCcMap(currentType, n1, n2, valFrom, valTo)){
+				editImage();
+				if (setCcMap(currentType, n1, n2, valFrom, valTo, NULL)){
 					errormessage("Error: invalid mapping, aborting");
 					exit(-1);
 				}
@@ -624,283 +4171,65 @@ int main(int argc, char *argv[]) {
 		errormessage("Ignoring unexpected trailing parameter: %s", argv[i-1]);
 		// exit(-1);
 	}
+	if (port==NULL) newPort("default");
+	for(int n=0; n<portCount; n++){
+		port=ports[n];
+		for(int b=0; b<port->bankCount; b++){
+			if (!port->banks[b]->parmDecode) continue;
+			for(int cc=0; cc<map_size; cc++){
+				if(isParmCc(cc) && (port->banks[b]->ccMaps[cc].destCount || port->banks[b]->ccMaps[cc].hiRes!=HIRES_NONE)){
+					errormessage("Warning: CC %u mapping in bank %s is ignored, it is used for NRPN/RPN input", cc, port->banks[b]->name);
+				}
+			}
+		}
+	}
+	if (compileFile){
+		// Maps of the last port
+		writeMapImage(compileFile);
+		exit(0);
+	}
+	resolveRoutes();
+	struct Scanner *scanner=selectScanner();
+	if (verbose) printf("Status scanner: %s\n", scanner->name);
+	if (filter>=0){
+		filterStdin(filter);
+		exit(0);
+	}
+	if (benchBuffers){
+		benchPipeline(benchBuffers, scanner);
+		exit(0);
+	}
 	fflush(stdout);
-	
-	if ((openStatus = snd_rawmidi_open(&midiin, &midiout, "virtual", mode)) < 0) {
-		errormessage("Problem opening MIDI input: %s", snd_strerror(openStatus));
+
+	for(int n=0; n<portCount; n++){
+		port=ports[n];
+		openPort(mode);
+	}
+	if (pipe(stopPipe)){
+		errormessage("Problem creating pipe: %s", strerror(errno));
 		exit(1);
 	}
-	// Hoped to retrieve the actual name, like "Client-133" but this just returns "virtual"
-	// printf ("Opened MIDI in: %s, out: %s \n", snd_rawmidi_name(midiin), snd_rawmidi_name(midiout));
-
-	int count = 0;
-	// Stats on bytes received.
-	// int status_count = 0;
-	// int data_count = 0;
-	// int total_count = 0;
-	char inBuffer[buf_size];
-	unsigned char outBuffer[buf_size]; // cc 99, 98, 6, optionally 38, + reset rpn
-	int k; // Index in outBuffer
-	// printf("\nEAGAIN: %d %s %s", EAGAIN, snd_strerror(-EAGAIN), snd_strerror(EAGAIN));
-	// -> EAGAIN=11 Resource temporarily unavailable
-	// fflush(stdout);
-	// readStatus = snd_rawmidi_read(midiin, &inBuffer[count], 1); // -11 on non-blocking, 1 on blocking
-	// readStatus = snd_rawmidi_read(midiin, &inBuffer[count], 3); // 3 on blocking
-	// if(readStatus>0) count=readStatus;
-	// printf("\n#read readStatus %d %s\n", readStatus, snd_strerror(readStatus));
-	// fflush(stdout);
-	// for(int i=0; i<count; i++){
-	//	   printf("%u ", (unsigned char)inBuffer[i]);
-	// };
-	readState = PASSTHRU;
-	
 	signal(SIGINT, intHandler); // Catch Ctl-C
-	
-	if (verbose) printf("Waiting for MIDI messages...\n");
-	while (keepRunning) {
-		/* MIDI read, blocking version - don't use
-		// blocking mode on "virtual" drops bytes ???
-		while (count<buf_size && readStatus == 1) {
-			readStatus = snd_rawmidi_read(midiin, &inBuffer[count++], 1);
-		}
-		printf("\n>read readStatus: %d %s, count: %d\n", readStatus, snd_strerror(readStatus), count);
-		*/
-		
-		// MIDI read, non-blocking version
-		count = 0;
-		readStatus = snd_rawmidi_read(midiin, inBuffer, buf_size);
-		while (readStatus == -EAGAIN && keepRunning) { // Keep polling
-			usleep(320); // One physical MIDI byte (10 bits at 31250 bps)
-			readStatus = snd_rawmidi_read(midiin, inBuffer, buf_size);
-		}
-		// snd_rawmidi_drain(midiin); // Stuck on C0 anyway ??
-		// printf("\n>read status: %d %s, count: %d\n", readStatus, readStatus>0?"ok":snd_strerror(readStatus), count);
-		if (readStatus>0){
-			count = readStatus; // Not pretty
-		}else{
-			if (keepRunning) errormessage("Problem reading MIDI input: %s", snd_strerror(readStatus));
-			break;
-		}
-		// total_count+=count;
-		
-		if(verbose>1){
-			printf("\n[%u]", count);
-			dump(inBuffer, count);
-			fflush(stdout);
-		}
 
-		for(int i=0; i<count; i++){
-			if (inBuffer[i] & 0x80){ // Received status byte, 80..FF
-		        if(verbose>1) printf("S");
-				runningStatusIn=inBuffer[i];
-				channel = runningStatusIn & 0x0F;
-				// data_count=data_length[(runningStatusIn & 0x70)>>4];
-				switch(runningStatusIn & 0xF0) {
-					case 0xB0:
-						readState = GOT_CC;
-						break;
-					case 0xD0:
-						readState = GOT_AT;
-						break;
-					case 0xE0:
-						readState = GOT_PB;
-						break;
-					default:
-						readState = PASSTHRU;
-				}
-			}else{ // Received data byte, 00..7F
-		        if (verbose>1) printf("D");
-		        switch (readState){
-				case PASSTHRU:
-					break;
-				case GOT_CC: // Got a cc number
-					// Next state depends on map type
-					if(verbose>1) printf("1");
-					ccNum=inBuffer[i];
-					switch (ccMaps[ccNum].type){
-					case NONE: // No mapping, pass message unchanged
-						k=0;
-						// Catch up with status
-						outBuffer[k++]=runningStatusIn;
-						if(verbose>1) printf("s");
-						// Send unchanged cc number
-						outBuffer[k++]=ccNum;
-						midiSend(midiout, outBuffer, k, &runningStatusOut);
-						// Alternatively we could send everything in PROCESS_CC_NONE
-						readState = PROCESS_CC_NONE;
-						break;
-					case NRPN:
-					case RPN:
-						readState = PROCESS_CC_PARM;
-						// Do nothing until value is received
-						// We don't need to resend status since RPN/NRPN use multiple CC
-						break;
-					case CC:
-						k=0;
-						// Catch up with status
-						outBuffer[k++]=runningStatusIn;
-						if(verbose>1) printf("s");					
-						// Send remapped cc
-						outBuffer[k++]=ccMaps[ccNum].num & 0x7F;
-						midiSend(midiout, outBuffer, k, &runningStatusOut);
-						if(verbose>1) printf("c 0x%02x ", ccMaps[ccNum].num);
-						readState = PROCESS_CC_CC; // Next byte will be cc value
-						break;
-					case PB:
-						readState = PROCESS_CC_PB;
-						// Do nothing until value is received
-						// (we could already send new status if needed)
-						break;
-					case AT:
-						readState = PROCESS_CC_AT;
-						// Do nothing until value is received
-						// (we could already send new status if needed)
-						break;
-					default: // }else{
-						errormessage("Internal error - unknown cc map type %u\n", ccMaps[ccNum].type);
-						exit(-1);
-					}
-					break;
-				case PROCESS_CC_PARM: // RPN/NRPN mapping specific
-					if(verbose>1) printf("2");
-					ccVal=inBuffer[i];
-					midiSendParm(midiout, outBuffer, &runningStatusOut, channel, &ccMaps[ccNum], ccVal, mapToMax[CC]);
-					readState = GOT_CC;
-					break;
-				case PROCESS_CC_NONE:
-					midiSend(midiout, &inBuffer[i], 1, &runningStatusOut);
-					readState = GOT_CC; // Ready for more cc (or new status)
-					break;
-				case PROCESS_CC_CC:
-				    // CC mapping specific, send value
-					// Like passthru except a cc num could follow (running status is 0xB_ )
-					// Hence next state GOT_CC
-					// We already sent the status and cc num at the previous GOT_CC state
-					// (thus potentially gaining a few milliseconds)
-					ccVal=ccMaps[ccNum].valFrom+inBuffer[i]*(ccMaps[ccNum].valTo-ccMaps[ccNum].valFrom)/127;
-					if (ccVal<0) ccVal=0;
-					if (ccVal>127) ccVal=127;
-					outBuffer[0]=ccVal;
-					midiSend(midiout, outBuffer, 1, &runningStatusOut);
-					readState = GOT_CC; // Ready for more cc (or new status)
-					break;
-				case PROCESS_CC_PB:
-				    // Pitch bend mapping specific, send scaled value
-				    // Signed pitched change is represented by an unsigned with offset +8192
-				    // i.e. values below 8192 are interpreted as negative by synths
-				    ccVal=inBuffer[i];
-					midiSendPb(midiout, outBuffer, &runningStatusOut, channel, &ccMaps[ccNum], ccVal, mapToMax[CC]);
-					// We came here by processing a cc, more cc data bytes can follow
-					readState = GOT_CC;
-					break;
-				case PROCESS_CC_AT:
-				    ccVal=inBuffer[i];
-					midiSendAt(midiout, outBuffer, &runningStatusOut, channel, &ccMaps[ccNum], ccVal, mapToMax[CC]);
-					// We came here by processing a cc, more cc data bytes can follow
-					readState = GOT_CC;
-					break;
-				case GOT_AT:
-					// AT message is only 2 bytes, we now have the full message
-					if(verbose>1) printf("A");
-					atVal=inBuffer[i];
-					switch (atMap.type){
-						case NONE:
-							newStatusOut=runningStatusIn;
-							k=0;
-							if(newStatusOut!=runningStatusOut){
-								outBuffer[k++]=newStatusOut;
-							}
-							outBuffer[k++]=atVal;
-							midiSend(midiout, outBuffer, k, &runningStatusOut);
-							break;
-						case CC:
-							midiSendCc(midiout, outBuffer, &runningStatusOut, channel, &atMap, atVal, mapToMax[AT]);
-							break;
-						case RPN:
-						case NRPN:
-							midiSendParm(midiout, outBuffer, &runningStatusOut, channel, &atMap, atVal, mapToMax[AT]);
-							break;
-						case PB:
-					        midiSendPb(midiout, outBuffer, &runningStatusOut, channel, &atMap, atVal, mapToMax[AT]);
-							break;
-						case AT:
-					        midiSendAt(midiout, outBuffer, &runningStatusOut, channel, &atMap, atVal, mapToMax[AT]);
-							break;
-						default:
-							errormessage("Internal error - unknown aftertouch map type %u\n", atMap.type);
-							exit(-1);
-					}
-					// We'll never need to resend input status:
-					// - if next input message is aftertouch it will map to the same output status
-					// - if not it will already have an explicit status
-					readState = GOT_AT; // Handle input running status, ready to receive more aftertouch data
-					break;
-				case GOT_PB:
-					if(verbose>1) printf("P");
-					pbLSB=inBuffer[i]&0x7F; // LSB only for now, will receive MSB later
-					readState = PROCESS_PB;
-					break;
-				case PROCESS_PB:
-					pbVal=pbLSB+((inBuffer[i]&0x7F)<<7); // Merge MSB with previously received LSB
-					// printf("[%u %u]", pbVal, pbMap.type);
-					switch (pbMap.type){
-						case NONE:
-							newStatusOut=runningStatusIn;
-							k=0;
-							if(newStatusOut!=runningStatusOut){
-								outBuffer[k++]=newStatusOut;
-							}
-							outBuffer[k++]=pbVal&0x7F;
-							outBuffer[k++]=(pbVal>>7)&0x7F;
-							midiSend(midiout, outBuffer, k, &runningStatusOut);
-							break;
-						case CC:
-							midiSendCc(midiout, outBuffer, &runningStatusOut, channel, &pbMap, pbVal, mapToMax[PB]);
-							break;
-						case RPN:
-						case NRPN:
-							midiSendParm(midiout, outBuffer, &runningStatusOut, channel, &pbMap, pbVal, mapToMax[PB]);
-							break;
-						case PB:
-					        midiSendPb(midiout, outBuffer, &runningStatusOut, channel, &pbMap, pbVal, mapToMax[PB]);
-							break;
-						case AT:
-					        midiSendAt(midiout, outBuffer, &runningStatusOut, channel, &pbMap, pbVal, mapToMax[PB]);
-							break;
-						default:
-							errormessage("Internal error - unknown pitch bend map type %u\n", pbMap.type);
-							exit(-1);
-					}
-					readState = GOT_PB; // Keep'm coming
-					break;
-				default:
-					errormessage("Internal error - unexpected read state %u", readState);
-					exit(-1);
-				} // End of switch readState
-			}
-			if (readState == PASSTHRU){
-				midiSend(midiout, &inBuffer[i], 1, &runningStatusOut);
-		        if(inBuffer[i]&0x80){
-					if(verbose){
-						printf("s");
-						fflush(stdout);
-					}
-				}else{
-					if(verbose){
-						printf(".");
-						fflush(stdout);
-					}
-				}
-			}
+	if (verbose) printf("Waiting for MIDI messages...\n");
+	for(int t=1; t<threadCount; t++){
+		if (pthread_create(&threads[t], NULL, servePorts, (void *)(intptr_t)t)){
+			errormessage("Problem starting thread %d", t);
+			exit(1);
 		}
-		// count=0;
-	} // End of main while (1) loop
+	}
+	servePorts((void *)0);
+	for(int t=1; t<threadCount; t++){
+		pthread_join(threads[t], NULL);
+	}
 
-//	printf("\nTotal:%5u\n", total_count);
     printf("\nBye!\n");
-	snd_rawmidi_close(midiin);
-	midiin  = NULL;    // snd_rawmidi_close() does not clear invalid pointer,
-	return 0;          // so might be a good idea to erase it after closing.
+	for(int n=0; n<portCount; n++){
+		port=ports[n];
+		if (verbose || port->overruns || port->xrunsOut || port->heldDropped) portStats();
+		closePort();
+	}
+	return 0;
 }
 
 ///////////////////////////////////////////////////////////////////////////